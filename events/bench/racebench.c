@@ -0,0 +1,658 @@
+ /**************************************************************
+ * Racing benchmark
+ *
+ * Runs racing.c outside the server: the module is compiled into this
+ * program and loaded against stub interfaces. It then drives a made-up
+ * race of N racers down a straight track past a rocket area, a number
+ * of checkpoints and the finish line, with every racer sending a
+ * position packet each tenth of a second on a simulated clock.
+ *
+ * At the end it reports how long racing.c spent in each callback and
+ * timer, and how many database queries, chat messages and object
+ * toggle batches it sent, so changes to the module can be compared by
+ * the numbers.
+ *
+ * Usage:
+ *   racebench [racers] [checkpoints] [-v]
+ *   ; defaults are 50 racers and 5 checkpoints, -v prints chat
+ *
+ * Build against an ASSS source tree, from this directory:
+ *   gcc -O2 -I$ASSS/src/include -o racebench racebench.c -lpthread -lm
+ *
+ * The stubs stand in for ASSS's util.c as well (the clock, astrncpy
+ * and the export queue), so nothing else needs to be linked.
+ *
+ **************************************************************/
+
+#define _GNU_SOURCE
+#include <time.h>
+#include <stdarg.h>
+
+#include "../racing.c"
+
+/************************************************************************/
+/*                             Measurements                             */
+/************************************************************************/
+
+typedef struct Stat
+{
+    const char *name;
+    long calls;
+    double total;  //microseconds
+    double max;
+} Stat;
+
+enum { ST_START, ST_POSITION, ST_REGION, ST_TIMUP, ST_ROCKET, ST_STANDINGS, ST_GHOST, ST_NEXTWAVE, ST_MAX };
+
+local Stat stats[ST_MAX] =
+{
+    { "?start" }, { "Position" }, { "EnterRegion" }, { "TimeUp" },
+    { "RocketArea" }, { "StandingsTick" }, { "GhostTick" }, { "NextWave" }
+};
+
+local long queries, messages, toggles, exports;
+local int verbose;
+
+local double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+local void Measure(int which, double start)
+{
+    double spent = now_us() - start;
+    stats[which].calls++;
+    stats[which].total += spent;
+    if (spent > stats[which].max)
+        stats[which].max = spent;
+}
+
+/************************************************************************/
+/*                          Simulated util.c                            */
+/************************************************************************/
+
+local ticks_t simticks;
+
+ticks_t current_ticks(void)
+{
+    return simticks;
+}
+
+ticks_t current_millis(void)
+{
+    return simticks * 10;
+}
+
+char *astrncpy(char *dest, const char *source, size_t n)
+{
+    strncpy(dest, source, n - 1);
+    dest[n - 1] = '\0';
+    return dest;
+}
+
+//export lines are counted and dropped, and the writer thread exits at once
+void MPInit(MPQueue *q) { }
+void MPDestroy(MPQueue *q) { }
+void MPAdd(MPQueue *q, void *data)
+{
+    WriteJob *job = data;
+    if (job)
+    {
+        if (job->line)
+            exports++;
+        free(job->line);
+        free(job->samples);
+        free(job);
+    }
+}
+void *MPRemove(MPQueue *q)
+{
+    return NULL;
+}
+
+/************************************************************************/
+/*                               The Track                              */
+/************************************************************************/
+
+/* Regions are opaque to modules, so they can be whatever we like here */
+struct Region
+{
+    char name[16];
+    int x1, x2;  //tiles, the whole height of the map
+};
+
+#define BENCH_MAX_REGIONS (RACE_MAX_SPLITS + 2)
+#define START_X 100
+#define LANE_Y 512
+
+local struct Region regions[BENCH_MAX_REGIONS];
+local int nregions;
+
+local void BuildTrack(int checkpoints)
+{
+    int i;
+
+    snprintf(regions[0].name, sizeof(regions[0].name), "rocket");
+    regions[0].x1 = START_X + 40;
+    regions[0].x2 = START_X + 50;
+    nregions = 1;
+
+    for (i = 1; i <= checkpoints; i++, nregions++)
+    {
+        snprintf(regions[nregions].name, sizeof(regions[nregions].name), "checkpoint%d", i);
+        regions[nregions].x1 = START_X + 100 * i;
+        regions[nregions].x2 = START_X + 100 * i + 4;
+    }
+
+    snprintf(regions[nregions].name, sizeof(regions[nregions].name), "finish");
+    regions[nregions].x1 = START_X + 100 * (checkpoints + 1);
+    regions[nregions].x2 = regions[nregions].x1 + 4;
+    nregions++;
+}
+
+local Region *FindRegionByName(Arena *arena, const char *name)
+{
+    int i;
+    for (i = 0; i < nregions; i++)
+        if (strcmp(regions[i].name, name) == 0)
+            return &regions[i];
+    return NULL;
+}
+
+local const char *RegionName(Region *rgn)
+{
+    return rgn->name;
+}
+
+local int Contains(Region *rgn, int x, int y)
+{
+    return x >= rgn->x1 && x < rgn->x2;
+}
+
+local Imapdata stub_mapdata;
+
+/************************************************************************/
+/*                               Stubs                                  */
+/************************************************************************/
+
+/* Timers, run off the simulated clock */
+typedef struct BenchTimer
+{
+    TimerFunc func;
+    void *param, *key;
+    int interval;
+    ticks_t when;
+    int stat;
+} BenchTimer;
+
+#define BENCH_MAX_TIMERS 64
+local BenchTimer timers[BENCH_MAX_TIMERS];
+
+local int TimerStat(TimerFunc func)
+{
+    if (func == TimeUp) return ST_TIMUP;
+    if (func == RocketArea) return ST_ROCKET;
+    if (func == StandingsTick) return ST_STANDINGS;
+    if (func == GhostTick) return ST_GHOST;
+    if (func == NextWave) return ST_NEXTWAVE;
+    return -1;
+}
+
+local void SetTimer(TimerFunc func, int initialdelay, int interval, void *param, void *key)
+{
+    int i;
+    for (i = 0; i < BENCH_MAX_TIMERS; i++)
+    {
+        if (!timers[i].func)
+        {
+            timers[i].func = func;
+            timers[i].param = param;
+            timers[i].key = key;
+            timers[i].interval = interval;
+            timers[i].when = simticks + initialdelay;
+            timers[i].stat = TimerStat(func);
+            return;
+        }
+    }
+}
+
+local void ClearTimer(TimerFunc func, void *key)
+{
+    int i;
+    for (i = 0; i < BENCH_MAX_TIMERS; i++)
+        if (timers[i].func == func && (!key || timers[i].key == key))
+            timers[i].func = NULL;
+}
+
+local void RunTimers(void)
+{
+    int i;
+    for (i = 0; i < BENCH_MAX_TIMERS; i++)
+    {
+        BenchTimer *t = &timers[i];
+        if (!t->func || TICK_GT(t->when, simticks))
+            continue;
+
+        TimerFunc func = t->func;
+        double start = now_us();
+        int again = func(t->param);
+        if (t->stat >= 0)
+            Measure(t->stat, start);
+
+        //the timer may have been cleared, or its slot reused, meanwhile
+        if (t->func == func)
+        {
+            if (again)
+                t->when = simticks + t->interval;
+            else
+                t->func = NULL;
+        }
+    }
+}
+
+/* Callbacks: only the arena's position and region handlers are driven */
+local void (*ppkcb)(Player *p, const struct C2SPosition *pos);
+local void (*regioncb)(Player *p, Region *rgn, int x, int y, int entering);
+
+local void RegCallback(const char *id, void *func, Arena *arena)
+{
+    if (strcmp(id, CB_PPK) == 0)
+        ppkcb = func;
+    else if (strcmp(id, CB_REGION) == 0)
+        regioncb = func;
+}
+
+local void UnregCallback(const char *id, void *func, Arena *arena)
+{
+    if (strcmp(id, CB_PPK) == 0)
+        ppkcb = NULL;
+    else if (strcmp(id, CB_REGION) == 0)
+        regioncb = NULL;
+}
+
+/* Commands */
+local CommandFunc startcmd;
+
+local void AddCommand(const char *name, CommandFunc func, Arena *arena, helptext_t help)
+{
+    if (strcmp(name, "start") == 0)
+        startcmd = func;
+}
+
+local void RemoveCommand(const char *name, CommandFunc func, Arena *arena) { }
+
+/* Chat: counted, and printed with -v */
+local void Say(const char *fmt, va_list args)
+{
+    messages++;
+    if (verbose)
+    {
+        printf("[%6.2f] ", (float)simticks / 100);
+        vprintf(fmt, args);
+        printf("\n");
+    }
+}
+
+local void SendMessage_(Player *p, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    Say(fmt, args);
+    va_end(args);
+}
+
+local void SendArenaMessage(Arena *arena, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    Say(fmt, args);
+    va_end(args);
+}
+
+local void SendArenaSoundMessage(Arena *arena, char sound, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    Say(fmt, args);
+    va_end(args);
+}
+
+local void SendModMessage(const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    Say(fmt, args);
+    va_end(args);
+}
+
+/* Database: every query succeeds with no rows */
+struct db_res { int unused; };
+local struct db_res emptyres;
+
+local int Query(query_callback cb, void *clos, int notifyfail, const char *fmt, ...)
+{
+    queries++;
+    if (cb)
+        cb(0, &emptyres, clos);
+    return 1;
+}
+
+local int GetRowCount(db_res *res) { return 0; }
+local db_row *GetRow(db_res *res) { return NULL; }
+local const char *GetField(db_row *row, int col) { return ""; }
+
+/* Settings: a few that make the race exercise more of the module */
+local int GetInt(ConfigHandle ch, const char *section, const char *key, int def)
+{
+    if (strcmp(section, "Race") == 0 && strcmp(key, "Standings") == 0)
+        return 5;
+    if (strcmp(key, "MaximumSpeed") == 0)
+        return 4000;
+    return def;
+}
+
+local const char *GetStr(ConfigHandle ch, const char *section, const char *key)
+{
+    if (strcmp(section, "Race") == 0 && strcmp(key, "GhostDir") == 0)
+        return "/tmp/racebench-ghosts";
+    return NULL;
+}
+
+/* Everything else racing.c calls does nothing */
+local int HasCapability(Player *p, const char *cap) { return 1; }
+local int AllocatePlayerData(size_t bytes);
+local int AllocateArenaData(size_t bytes);
+local void FreeData(int key) { }
+local void Lock(void) { }
+local void SendClientSettings(Player *p) { }
+local override_key_t GetOverrideKey(const char *section, const char *key) { return 1; }
+local void ArenaOverride(Arena *arena, override_key_t key, i32 val) { }
+local Arena *thearena;
+local Arena *FindArena(const char *name, int *total, int *playing) { return thearena; }
+local Player *CreateFakePlayer(const char *name, Arena *arena, int ship, int freq) { return NULL; }
+local int EndFaked(Player *p) { return 1; }
+local void SetShipAndFreq(Player *p, int ship, int freq) { p->p_ship = ship; p->p_freq = freq; }
+local void SetShip(Player *p, int ship) { p->p_ship = ship; }
+local void SetFreq(Player *p, int freq) { p->p_freq = freq; }
+local void WarpTo(const Target *t, int x, int y) { }
+local void GivePrize(const Target *t, int type, int count) { }
+local void ShipReset(const Target *t) { }
+local void FakePosition(Player *p, struct C2SPosition *pos, int len) { }
+local void QueryPPing(Player *p, struct PingSummary *s) { memset(s, 0, sizeof(*s)); }
+local void QueryTimeSyncHistory(Player *p, struct TimeSyncHistory *s) { memset(s, 0, sizeof(*s)); }
+local void Log(char level, const char *fmt, ...) { }
+local void LogP(char level, const char *mod, Player *p, const char *fmt, ...) { }
+local void ToggleSet(const Target *t, short *id, char *ons, int size) { toggles++; }
+
+local Iarenaman stub_aman;
+local Icapman stub_capman;
+local Iconfig stub_cfg;
+local Ichat stub_chat;
+local Icmdman stub_cmd;
+local Iclientset stub_cs;
+local Ifake stub_fake;
+local Igame stub_game;
+local Ilagquery stub_lagq;
+local Ilogman stub_lm;
+local Imainloop stub_ml;
+local Iplayerdata stub_pd;
+local Ireldb stub_db;
+local Iobjects stub_obj;
+local Imodman stub_mm;
+
+/* Extra data lives after the Player and Arena structs, at these offsets.
+ * racing.c treats a key of 0 as failure, so the first one is skipped. */
+local int pdsize = 8, adsize = 8;
+
+local int AllocatePlayerData(size_t bytes)
+{
+    int key = pdsize;
+    pdsize += (bytes + 7) & ~7;
+    return key;
+}
+
+local int AllocateArenaData(size_t bytes)
+{
+    int key = adsize;
+    adsize += (bytes + 7) & ~7;
+    return key;
+}
+
+local void *GetInterface(const char *id, Arena *arena)
+{
+    if (!strcmp(id, I_ARENAMAN)) return &stub_aman;
+    if (!strcmp(id, I_CAPMAN)) return &stub_capman;
+    if (!strcmp(id, I_CONFIG)) return &stub_cfg;
+    if (!strcmp(id, I_CHAT)) return &stub_chat;
+    if (!strcmp(id, I_CMDMAN)) return &stub_cmd;
+    if (!strcmp(id, I_CLIENTSET)) return &stub_cs;
+    if (!strcmp(id, I_FAKE)) return &stub_fake;
+    if (!strcmp(id, I_GAME)) return &stub_game;
+    if (!strcmp(id, I_LAGQUERY)) return &stub_lagq;
+    if (!strcmp(id, I_LOGMAN)) return &stub_lm;
+    if (!strcmp(id, I_MAINLOOP)) return &stub_ml;
+    if (!strcmp(id, I_MAPDATA)) return &stub_mapdata;
+    if (!strcmp(id, I_PLAYERDATA)) return &stub_pd;
+    if (!strcmp(id, I_RELDB)) return &stub_db;
+    if (!strcmp(id, I_OBJECTS)) return &stub_obj;
+    return NULL;
+}
+
+local void ReleaseInterface(void *iface) { }
+
+local void InitStubs(void)
+{
+    stub_mm.GetInterface = GetInterface;
+    stub_mm.ReleaseInterface = ReleaseInterface;
+    stub_mm.RegCallback = RegCallback;
+    stub_mm.UnregCallback = UnregCallback;
+
+    stub_aman.AllocateArenaData = AllocateArenaData;
+    stub_aman.FreeArenaData = FreeData;
+    stub_aman.FindArena = FindArena;
+    stub_aman.Lock = Lock;
+    stub_aman.Unlock = Lock;
+    stub_capman.HasCapability = HasCapability;
+    stub_cfg.GetInt = GetInt;
+    stub_cfg.GetStr = GetStr;
+    stub_chat.SendMessage = SendMessage_;
+    stub_chat.SendArenaMessage = SendArenaMessage;
+    stub_chat.SendArenaSoundMessage = SendArenaSoundMessage;
+    stub_chat.SendModMessage = SendModMessage;
+    stub_cmd.AddCommand = AddCommand;
+    stub_cmd.RemoveCommand = RemoveCommand;
+    stub_cs.SendClientSettings = SendClientSettings;
+    stub_cs.GetOverrideKey = GetOverrideKey;
+    stub_cs.ArenaOverride = ArenaOverride;
+    stub_fake.CreateFakePlayer = CreateFakePlayer;
+    stub_fake.EndFaked = EndFaked;
+    stub_game.SetShipAndFreq = SetShipAndFreq;
+    stub_game.SetShip = SetShip;
+    stub_game.SetFreq = SetFreq;
+    stub_game.WarpTo = WarpTo;
+    stub_game.GivePrize = GivePrize;
+    stub_game.ShipReset = ShipReset;
+    stub_game.FakePosition = FakePosition;
+    stub_lagq.QueryPPing = QueryPPing;
+    stub_lagq.QueryTimeSyncHistory = QueryTimeSyncHistory;
+    stub_lm.Log = Log;
+    stub_lm.LogP = LogP;
+    stub_ml.SetTimer = SetTimer;
+    stub_ml.ClearTimer = ClearTimer;
+    stub_mapdata.FindRegionByName = FindRegionByName;
+    stub_mapdata.RegionName = RegionName;
+    stub_mapdata.Contains = Contains;
+    stub_pd.AllocatePlayerData = AllocatePlayerData;
+    stub_pd.FreePlayerData = FreeData;
+    stub_pd.Lock = Lock;
+    stub_pd.Unlock = Lock;
+    stub_db.Query = Query;
+    stub_db.GetRowCount = GetRowCount;
+    stub_db.GetRow = GetRow;
+    stub_db.GetField = GetField;
+    stub_obj.ToggleSet = ToggleSet;
+}
+
+/************************************************************************/
+/*                              The Race                                */
+/************************************************************************/
+
+local Link arenalink;
+
+local Arena *MakeArena(void)
+{
+    Arena *arena = calloc(1, sizeof(Arena) + adsize);
+    astrncpy(arena->name, "racebench", sizeof(arena->name));
+    astrncpy(arena->basename, "racebench", sizeof(arena->basename));
+    arena->specfreq = 8025;
+    thearena = arena;
+
+    //the track record reply looks the arena up in the arena list
+    arenalink.data = arena;
+    arenalink.next = NULL;
+    stub_aman.arenalist.start = stub_aman.arenalist.end = &arenalink;
+    return arena;
+}
+
+local Player *MakePlayer(Arena *arena, int i, Link *link)
+{
+    Player *p = calloc(1, sizeof(Player) + pdsize);
+    snprintf(p->name, sizeof(p->name), "racer%d", i);
+    p->pid = i;
+    p->type = T_CONT;
+    p->arena = arena;
+    p->p_ship = i ? SHIP_WARBIRD : SHIP_SPEC;
+    p->p_freq = i ? 0 : arena->specfreq;
+    p->position.x = START_X * 16;
+    p->position.y = LANE_Y * 16;
+
+    //hang the player off the player list
+    link->data = p;
+    link->next = NULL;
+    if (stub_pd.playerlist.end)
+        stub_pd.playerlist.end->next = link;
+    else
+        stub_pd.playerlist.start = link;
+    stub_pd.playerlist.end = link;
+    return p;
+}
+
+/* Move a racer along for one packet, firing the callbacks the server would */
+local void Drive(Player *p, int speed)
+{
+    int oldx = p->position.x >> 4;
+
+    p->position.x += speed;
+    int x = p->position.x >> 4, y = p->position.y >> 4;
+
+    struct C2SPosition pos;
+    memset(&pos, 0, sizeof(pos));
+    pos.time = simticks;
+    pos.x = p->position.x;
+    pos.y = p->position.y;
+
+    if (ppkcb)
+    {
+        double start = now_us();
+        ppkcb(p, &pos);
+        Measure(ST_POSITION, start);
+    }
+
+    int i;
+    for (i = 0; i < nregions && regioncb; i++)
+    {
+        if (x >= regions[i].x1 && oldx < regions[i].x1)
+        {
+            double start = now_us();
+            regioncb(p, &regions[i], x, y, 1);
+            Measure(ST_REGION, start);
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int nracers = 50, checkpoints = 5, i;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-v") == 0)
+            verbose = 1;
+        else if (i == 1)
+            nracers = atoi(argv[i]);
+        else
+            checkpoints = atoi(argv[i]);
+    }
+    if (nracers < 1 || nracers > RACE_MAX_RACERS)
+        nracers = 50;
+    if (checkpoints < 0 || checkpoints > RACE_MAX_SPLITS)
+        checkpoints = 5;
+
+    InitStubs();
+    BuildTrack(checkpoints);
+
+    if (MM_racing(MM_LOAD, &stub_mm, ALLARENAS) != MM_OK)
+    {
+        fprintf(stderr, "racing.c failed to load\n");
+        return 1;
+    }
+
+    Arena *arena = MakeArena();
+    MM_racing(MM_ATTACH, &stub_mm, arena);
+
+    Link *links = calloc(nracers + 1, sizeof(Link));
+    Player **players = calloc(nracers + 1, sizeof(Player *));
+    int *speeds = calloc(nracers + 1, sizeof(int));
+    srand(1);
+    for (i = 0; i <= nracers; i++)
+    {
+        players[i] = MakePlayer(arena, i, &links[i]);
+        //10 to 14 tiles a second
+        speeds[i] = 10 + rand() % 5;
+    }
+
+    /* racer0 is the host */
+    Target target;
+    target.type = T_ARENA;
+    target.u.arena = arena;
+
+    double start = now_us();
+    startcmd("start", "race", players[0], &target);
+    Measure(ST_START, start);
+
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+    ticks_t limit = 100 * 60 * 30;
+    for (simticks = 1; simticks < limit && adata->started; simticks++)
+    {
+        RunTimers();
+
+        //everyone sends a packet every ten ticks, spread over the ticks
+        for (i = 1; i <= nracers && adata->started == 2; i++)
+        {
+            Pdata *pdata = PPDATA(players[i], playerKey);
+            if ((simticks + i) % 10 == 0 && pdata->racing)
+                Drive(players[i], speeds[i] * 16 / 10);
+        }
+    }
+
+    printf("%d racers, %d checkpoints, race took %.2f simulated seconds%s\n\n",
+        nracers, checkpoints, (float)simticks / 100, adata->started ? " (gave up)" : "");
+
+    printf("%-14s %10s %12s %12s\n", "callback", "calls", "avg (us)", "max (us)");
+    for (i = 0; i < ST_MAX; i++)
+    {
+        if (!stats[i].calls)
+            continue;
+        printf("%-14s %10ld %12.3f %12.3f\n", stats[i].name, stats[i].calls,
+            stats[i].total / stats[i].calls, stats[i].max);
+    }
+
+    printf("\nqueries: %ld  messages: %ld  toggle batches: %ld  export lines: %ld\n",
+        queries, messages, toggles, exports);
+
+    MM_racing(MM_DETACH, &stub_mm, arena);
+    MM_racing(MM_UNLOAD, &stub_mm, ALLARENAS);
+    return 0;
+}
@@ -9,31 +9,126 @@
  * a specified amount of opponents, he wins. Should he/she happen
  * to die, then the new player becomes the juggernaut.
  *
+ * In timed games (-t), the game instead runs for a set number of
+ * seconds, and whoever spent the longest as the juggernaut wins.
+ *
+ * With -n, several juggernauts play at once. Juggernaut i holds
+ * flag i and plays on freq 100+i, so big arenas do not all swarm
+ * the same player.
+ *
  * Requirements
  *   The arena must have one defined flag in its settings that
- *     players can carry.
+ *     players can carry, per juggernaut.
+ *
+ * Flags spawn on open tiles inside the spawn area. The area is scanned
+ * when each game is started, and only the largest connected patch of
+ * open tiles is kept, so flags never land in walls or sealed pockets.
+ *
+ * Every game that ends with a winner is recorded: its length, winner,
+ * each handoff of a flag, and how every player did. The record is kept
+ * in memory while the game runs and written in one transaction at the
+ * end, to juggermatches, juggerhandoffs and juggerplayers. Players can
+ * see their totals with ?juggerstats, read from a summary loaded when
+ * they enter the arena. A database is optional; without one nothing is
+ * recorded.
  *
  * To start the event, a moderator just needs to type ?start jugger
  * (some options are available). Typing ?stop will cancel the event.
  *
+ * Arena settings:
+ *
+ * [ Jugger ]
+ *  SpawnRegion = flagspawn
+ *  ; region flags spawn in; if unset or missing, the rectangle below is used
+ *  SpawnLeft = 400
+ *  SpawnTop = 425
+ *  SpawnRight = 625
+ *  SpawnBottom = 625
+ *  ; tile rectangle flags spawn in (default 400,425 to 625,625)
+ *  Radar = 0
+ *  ; 1 = tell the arena which sector a juggernaut is in, 2 = move an
+ *  ; LVZ marker onto them, 0 = off (default 0)
+ *  RadarInterval = 1000
+ *  ; ticks between radar updates; each update shows one juggernaut,
+ *  ; taking turns when there are several (default 1000)
+ *  RadarObject = 2000
+ *  ; LVZ map object id of the marker for flag 0; flag i uses
+ *  ; RadarObject + i (default 2000)
+ *
  * Based on a plugin originally designed by user XDOOM for
  * Deva-bot, recreated by Zachary Read for the ASSS server.
  *
  **************************************************************/
 
 #include "asss.h"
+#include "reldb.h"
+#include "objects.h"
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
 
+#include "sqlhex.h"
+
 #define JUGGER_FREQ 100
 #define HUMAN_FREQ 0
+#define STANDINGS_INTERVAL 3000 //ticks between standings in timed games
+#define JUGGER_MAX_PLAYERS 256
+#define JUGGER_MAX 8        //most juggernauts at once, one flag each
+
+/* One player's part in the current game */
+typedef struct MatchEntry
+{
+    char name[24];
+    int won;          //1 = won the game
+    int kills;        //kills as a juggernaut
+    int reigns;       //times they became a juggernaut
+    int reigntime;    //ticks spent as a juggernaut
+    int longest;      //longest single reign, in ticks
+    int beststreak;   //most kills in one reign
+} MatchEntry;
+
+/* A flag changing hands */
+typedef struct Handoff
+{
+    int time;         //ticks into the game
+    int flag;
+    int how;          //0 = found the flag, 1 = killed the juggernaut
+    char from[24];    //empty if nobody held it
+    char to[24];
+} Handoff;
+
+/* A game's record on its way to the database */
+typedef struct MatchSave
+{
+    int pending;      //statements still to report back
+    int failed;       //1 = one of them failed
+    int matchid;      //id the match row got, 0 = none
+} MatchSave;
+
+/* Whose summary a query is loading, and for which arena */
+typedef struct SummaryQuery
+{
+    char name[24];
+    char arena[24];
+} SummaryQuery;
 
 /* Player data */
 typedef struct Pdata
 {
     int kills;        //the number of kills a player has acquired
+    int reigning;     //1 = currently the juggernaut
+    ticks_t reignstart; //when they became the juggernaut
+    int jtime;        //ticks spent as the juggernaut before that
+    int human;        //1 = in the arena's set of humans
+    int slot;         //index in that set
+    int jugger;       //flag id + 1 while a juggernaut, 0 = not one
+    int streak;       //kills in the current reign
+    int entry;        //match roster slot + 1, 0 = not looked up yet
+
+    /* Past games in this arena, loaded on entry */
+    int statsloaded;
+    int games, wins, totalkills, beststreak, longestreign, totaltime;
 } Pdata;
 
 local int playerKey;
@@ -41,12 +136,33 @@ local int playerKey;
 /* Arena data */
 typedef struct Adata
 {
-    int rkill;         //the required number of kills to win
+    int rkill;         //the required number of kills to win, 0 = none
+    int rtime;         //length of a timed game in seconds, 0 = not timed
     int lockships;     //0 = no, 1 = ships are restricted
     int started;       //0 = no game, 1 = pending, 2 = started
     int defaultship;   //this is the default ship if someone happens to change to a restricted ship
     int jship;         //the jugger's ship
     int jlockship;     //0 = no, 1 = jugger's ship is restricted
+    int njuggers;      //number of juggernauts (and flags) in play
+    Player *juggers[JUGGER_MAX]; //holder of each flag, NULL = nobody has it yet
+    Player *humans[JUGGER_MAX_PLAYERS]; //everyone else playing
+    int nhumans;
+    u32 *spawns;       //open tiles a flag can spawn on, packed as (y << 10) | x
+    int nspawns;
+    u32 seed;          //state of the arena's flag spawn generator
+
+    /* The record of the current game */
+    ticks_t matchstart;
+    MatchEntry *entries;
+    int nentries, maxentries;
+    Handoff *handoffs;
+    int nhandoffs, maxhandoffs;
+
+    /* Juggernaut radar */
+    int radar;         //0 = off, 1 = sector message, 2 = LVZ marker
+    int radarobject;   //marker id of flag 0
+    int radarnext;     //flag whose holder the next update shows
+    int radarshown;    //bit i set = marker i is on
 } Adata;
 
 local int arenaKey;
@@ -55,12 +171,74 @@ local int arenaKey;
 local Imodman *mm;
 local Iarenaman *aman;
 local Icapman *capman;
+local Iconfig *cfg;
 local Ichat *chat;
 local Icmdman *cmd;
 local Iflagcore *flags;
 local Igame *game;
 local Imainloop *ml;
+local Imapdata *mapdata;
 local Iplayerdata *pd;
+local Ireldb *db;
+local Iobjects *obj;
+
+#define CREATE_MATCHES_TABLE \
+" CREATE TABLE IF NOT EXISTS `juggermatches` (" \
+"  `id` int(11) NOT NULL auto_increment," \
+"  `arena` char(24) NOT NULL default ''," \
+"  `date` timestamp NOT NULL," \
+"  `duration` int(11) NOT NULL default '0'," \
+"  `juggernauts` int(11) NOT NULL default '1'," \
+"  `winner` varchar(24) NOT NULL default ''," \
+"  `handoffs` int(11) NOT NULL default '0'," \
+"  `longestreign` int(11) NOT NULL default '0'," \
+"  `longestreigner` varchar(24) NOT NULL default ''," \
+"  `beststreak` int(11) NOT NULL default '0'," \
+"  `beststreaker` varchar(24) NOT NULL default ''," \
+"  PRIMARY KEY  (`id`)," \
+"  KEY `arena_date` (`arena`,`date`)" \
+") ENGINE=InnoDB;"
+
+#define CREATE_HANDOFFS_TABLE \
+" CREATE TABLE IF NOT EXISTS `juggerhandoffs` (" \
+"  `matchid` int(11) NOT NULL," \
+"  `seq` int(11) NOT NULL," \
+"  `time` int(11) NOT NULL default '0'," \
+"  `flag` int(11) NOT NULL default '0'," \
+"  `how` int(11) NOT NULL default '0'," \
+"  `oldname` varchar(24) NOT NULL default ''," \
+"  `newname` varchar(24) NOT NULL default ''," \
+"  PRIMARY KEY  (`matchid`,`seq`)" \
+") ENGINE=InnoDB;"
+
+#define CREATE_PLAYERS_TABLE \
+" CREATE TABLE IF NOT EXISTS `juggerplayers` (" \
+"  `matchid` int(11) NOT NULL," \
+"  `arena` char(24) NOT NULL default ''," \
+"  `name` varchar(24) NOT NULL default ''," \
+"  `won` int(11) NOT NULL default '0'," \
+"  `kills` int(11) NOT NULL default '0'," \
+"  `reigns` int(11) NOT NULL default '0'," \
+"  `reigntime` int(11) NOT NULL default '0'," \
+"  `longestreign` int(11) NOT NULL default '0'," \
+"  `beststreak` int(11) NOT NULL default '0'," \
+"  PRIMARY KEY  (`matchid`,`name`)," \
+"  KEY `arena_name` (`arena`,`name`)" \
+") ENGINE=InnoDB;"
+
+#define INSERT_MATCH \
+"INSERT INTO `juggermatches` (`arena`, `date`, `duration`, `juggernauts`, `winner`, `handoffs`," \
+" `longestreign`, `longestreigner`, `beststreak`, `beststreaker`) VALUES (?, NOW(), #, #, ?, #, #, ?, #, ?);"
+
+/* The match's id, or 0 if its row didn't go in: LAST_INSERT_ID() would
+ * then still hold an older id, and the game's rows must not join it */
+#define SET_MATCHID \
+"SET @juggermatch = IF(ROW_COUNT() = 1, LAST_INSERT_ID(), 0);"
+
+#define SELECT_SUMMARY \
+"SELECT COUNT(*), COALESCE(SUM(`won`),0), COALESCE(SUM(`kills`),0), COALESCE(MAX(`beststreak`),0)," \
+" COALESCE(MAX(`longestreign`),0), COALESCE(SUM(`reigntime`),0)" \
+" FROM `juggerplayers` WHERE `arena`=? AND `name`=?;"
 
 local int allships[7];
 
@@ -70,28 +248,150 @@ local int allships[7];
 //interface functions
 local char* getOption(const char *string, char param);
 
+//database
+local void init_db(void);
+local void db_summary(int status, db_res *res, void *clos);
+local void db_save(int status, db_res *res, void *clos);
+local void db_savedid(int status, db_res *res, void *clos);
+local void Saved(MatchSave *save);
+local void LoadSummary(Player *p);
+
 //game functions
 local void Abort(Arena *arena, Player *host, int debug);
 local void Begin(Player *host, Arena *arena, const char *params);
 local void LegalShip(int ship, Arena *arena);
 local void CheckLegalShip(Arena *arena);
+local void CheckShip(Player *p);
 local int TimeUp(void *p);
-local void LCheck(Arena *arena, Player *pe);
+local void AddHuman(Arena *arena, Player *p);
+local void RemoveHuman(Arena *arena, Player *p);
+local void ClearPlayers(Arena *arena);
+local void LCheck(Arena *arena);
 local void Check(Player *p);
-local void HideFlag(Arena *arena);
-local void ShowFlag(Arena *arena);
-local void TransferFlag(Player *p);
-local void CheckPlayers(Arena *arena);
+local void SetJugger(Arena *arena, int fid, Player *p);
+local void FreeFlag(Arena *arena, int fid);
+local void DropJugger(Arena *arena, Player *p);
+local void HideFlag(Arena *arena, int fid);
+local void ShowFlag(Arena *arena, int fid);
+local void TransferFlag(Player *p, int fid);
+local int SpawnTile(Arena *arena, Region *rgn, int x, int y);
+local void BuildSpawns(Arena *arena);
+local u32 Random(Adata *adata);
+local void StartReign(Player *p);
+local void EndReign(Player *p);
+local int ReignTime(Player *p);
+local int Standings(void *a);
+local int TimeOver(void *a);
+local int RadarTick(void *a);
+local void ClearRadar(Arena *arena);
+local MatchEntry *Entry(Player *p);
+local void AddHandoff(Arena *arena, int fid, Player *from, Player *to, int how);
+local void EndMatch(Arena *arena, Player *winner);
+local void SaveMatch(Arena *arena, Player *winner);
+local void ClearMatch(Arena *arena);
 local void Stop(Arena* arena);
 
 //callbacks
 local void Kill(Arena *arena, Player *k, Player *p, int bounty, int flags, int pts, int green);
 local void ShipFreqChange(Player *p, int newship, int oldship, int newfreq, int oldfreq);
 local void PlayerAction(Player *p, int action, Arena *arena);
-local void Flaglost(Arena *arena, Player *p);
-local void Flaggain(Arena *arena, Player *p);
+local void Flaglost(Arena *arena, Player *p, int fid, int how);
+local void Flaggain(Arena *arena, Player *p, int fid, int how);
+local void StatsAction(Player *p, int action, Arena *arena);
 
 
+/************************************************************************/
+/*                   Main Database Interaction                          */
+/************************************************************************/
+
+local void init_db(void)
+{
+    db->Query(NULL, NULL, 0, CREATE_MATCHES_TABLE);
+    db->Query(NULL, NULL, 0, CREATE_HANDOFFS_TABLE);
+    db->Query(NULL, NULL, 0, CREATE_PLAYERS_TABLE);
+}
+
+/* A player's past games in an arena, loaded when they enter it */
+local void db_summary(int status, db_res *res, void *clos)
+{
+    SummaryQuery *query = clos;
+    Player *p = pd->FindPlayer(query->name);
+    int here = p && p->arena && !strcmp(p->arena->basename, query->arena);
+    free(query);
+
+    if (!here || status != 0 || res == NULL)
+        return;
+
+    db_row *row = db->GetRow(res);
+    if (!row)
+        return;
+
+    Pdata *pdata = PPDATA(p, playerKey);
+    pdata->games = atoi(db->GetField(row, 0));
+    pdata->wins = atoi(db->GetField(row, 1));
+    pdata->totalkills = atoi(db->GetField(row, 2));
+    pdata->beststreak = atoi(db->GetField(row, 3));
+    pdata->longestreign = atoi(db->GetField(row, 4));
+    pdata->totaltime = atoi(db->GetField(row, 5));
+    pdata->statsloaded = 1;
+}
+
+local void LoadSummary(Player *p)
+{
+    Pdata *pdata = PPDATA(p, playerKey);
+    pdata->statsloaded = 0;
+
+    if (!db)
+        return;
+
+    SummaryQuery *query = malloc(sizeof(SummaryQuery));
+    if (!query)
+        return;
+    astrncpy(query->name, p->name, sizeof(query->name));
+    astrncpy(query->arena, p->arena->basename, sizeof(query->arena));
+    db->Query(db_summary, query, 1, SELECT_SUMMARY, p->arena->basename, p->name);
+}
+
+/* One statement of a game's record has come back */
+local void db_save(int status, db_res *res, void *clos)
+{
+    MatchSave *save = clos;
+    if (status != 0)
+        save->failed = 1;
+    Saved(save);
+}
+
+/* The id the match row got */
+local void db_savedid(int status, db_res *res, void *clos)
+{
+    MatchSave *save = clos;
+    db_row *row;
+
+    if (status != 0 || res == NULL || !(row = db->GetRow(res)))
+        save->failed = 1;
+    else
+        save->matchid = atoi(db->GetField(row, 0));
+    Saved(save);
+}
+
+/* Once every statement is back: the transaction was committed whatever
+ * happened, so a record with a failed part is deleted again. A match id
+ * of 0 holds only the rows of games whose match row failed. */
+local void Saved(MatchSave *save)
+{
+    if (--save->pending)
+        return;
+
+    if (save->failed)
+    {
+        db->Query(NULL, NULL, 0, "DELETE FROM `juggerhandoffs` WHERE `matchid`=#;", (unsigned int)save->matchid);
+        db->Query(NULL, NULL, 0, "DELETE FROM `juggerplayers` WHERE `matchid`=#;", (unsigned int)save->matchid);
+        if (save->matchid)
+            db->Query(NULL, NULL, 0, "DELETE FROM `juggermatches` WHERE `id`=#;", (unsigned int)save->matchid);
+    }
+    free(save);
+}
+
 /************************************************************************/
 /*                          Interface Functions                         */
 /************************************************************************/
@@ -138,9 +438,11 @@ local void Abort(Arena *arena, Player *host, int debug)
     Adata *adata = P_ARENA_DATA(arena, arenaKey);
     adata->started = 0;
     adata->rkill = 0;
+    adata->rtime = 0;
     adata->lockships = 0;
     adata->jship = 0;
     adata->jlockship = 0;
+    adata->njuggers = 1;
 
     chat->SendMessage(host, "Game aborted: Invalid syntax. Please type '?start' for more help.");
 }
@@ -158,27 +460,45 @@ local void Begin(Player *host, Arena *arena, const char *params)
         adata->started = 1;
 
     /* Get Game Options*/
-    //kills
-    int rkills;
+    //kills and/or time; a game needs at least one way to end
+    int rkills, rtime;
     char *next, *string;
     string = getOption(params, 'k');
+    rkills = atoi(string);
+    string = getOption(params, 't');
+    rtime = atoi(string);
 
-    if (string != next)
+    if ((!rkills) && (!rtime))
     {
-        rkills = atoi(string);
-        if ((rkills <= 50) && (rkills > 0))
-            adata->rkill = rkills;
-        else
-        {
-            Abort(arena, host, 1);
-            return;
-        }
+        Abort(arena, host, 2);
+        return;
     }
-    else
+    if ((rkills < 0) || (rkills > 50) || (rtime < 0) || (rtime > 3600))
     {
-        Abort(arena, host, 2);
+        Abort(arena, host, 1);
+        return;
+    }
+    adata->rkill = rkills;
+    adata->rtime = rtime;
+
+    //number of juggernauts, one flag each
+    int njuggers = 1;
+    string = getOption(params, 'n');
+    if (strlen(string))
+        njuggers = atoi(string);
+    if ((njuggers < 1) || (njuggers > JUGGER_MAX))
+    {
+        Abort(arena, host, 5);
+        return;
+    }
+    if (njuggers > flags->CountFlags(arena))
+    {
+        chat->SendMessage(host, "This arena only has %i %s, not enough for %i juggernauts.",
+            flags->CountFlags(arena), flags->CountFlags(arena) == 1 ? "flag" : "flags", njuggers);
+        Abort(arena, host, 5);
         return;
     }
+    adata->njuggers = njuggers;
 
     //ships
     string = getOption(params, 's');
@@ -277,11 +597,18 @@ local void Begin(Player *host, Arena *arena, const char *params)
     
     if (adata->jlockship)
         chat->SendArenaMessage(arena, "Jugger ship: %i", adata->jship + 1);
+    if (adata->njuggers > 1)
+        chat->SendArenaMessage(arena, "Juggernauts: %i", adata->njuggers);
 
     CheckLegalShip(arena);
     
-    //Hide the Flag
-    HideFlag(arena);
+    //Hide the Flags
+    int fid;
+    for (fid = 0; fid < adata->njuggers; fid++)
+        HideFlag(arena, fid);
+
+    //the map isn't loaded when the module attaches, and may have changed since
+    BuildSpawns(arena);
 
     adata->started = 1;
     /* Start the timer */
@@ -295,40 +622,51 @@ local void LegalShip(int ship, Arena *arena)
     allships[ship] = 1;
 }
 
-/* Check if the player is in a legal ship */
+/* Check if everyone in the arena is in a legal ship */
 local void CheckLegalShip(Arena *arena)
 {
     Adata *adata = P_ARENA_DATA(arena, arenaKey);
     if (!adata->lockships)
         return;
 
-    int defaultship = adata->defaultship;
-
     Player *g;
     Link *link;
     pd->Lock();
     FOR_EACH_PLAYER(g)
     {
-        if ((g->arena == arena) && (g->p_ship != SHIP_SPEC) && (g->p_freq != JUGGER_FREQ))
-        {
-            int i, legal = 0;
-            for (i = 0; i < 8; i++)
-            {
-                if ((g->p_ship == i) && (allships[i] == 1))
-                    legal = 1;
-            }
-            if (!legal)
-                game->SetShip(g, defaultship);
-        }
-        else if ((g->arena == arena) && (g->p_ship != SHIP_SPEC) && (g->p_freq == JUGGER_FREQ))
+        if (g->arena == arena)
+            CheckShip(g);
+    }
+    pd->Unlock();
+}
+
+/* Check if one player is in a legal ship */
+local void CheckShip(Player *g)
+{
+    Adata *adata = P_ARENA_DATA(g->arena, arenaKey);
+    Pdata *pdata = PPDATA(g, playerKey);
+
+    if (g->p_ship == SHIP_SPEC)
+        return;
+
+    if (!pdata->jugger)
+    {
+        if (!adata->lockships)
+            return;
+
+        int i, legal = 0;
+        for (i = 0; i < 8; i++)
         {
-            if ((adata->jlockship) && (g->p_ship != adata->jship))
-            {
-                game->SetShip(g, adata->jship);
-            }
+            if ((g->p_ship == i) && (allships[i] == 1))
+                legal = 1;
         }
+        if (!legal)
+            game->SetShip(g, adata->defaultship);
+    }
+    else if ((adata->jlockship) && (g->p_ship != adata->jship))
+    {
+        game->SetShip(g, adata->jship);
     }
-    pd->Unlock();
 }
 
 /* After 20 seconds have passed */
@@ -356,6 +694,10 @@ local int TimeUp(void *p)
                 game->SetFreq(g, HUMAN_FREQ); //place everyone on team 0
                 Pdata *pdata = PPDATA(g, playerKey);
                 pdata->kills = 0;
+                pdata->reigning = 0;
+                pdata->jtime = 0;
+                pdata->entry = 0;
+                AddHuman(arena, g);
 
                 Target target;
                 target.type = T_PLAYER;
@@ -367,11 +709,39 @@ local int TimeUp(void *p)
     pd->Unlock();
 
     CheckLegalShip(arena);
+    adata->matchstart = current_ticks();
     
-    //Reveal the flag location
-    ShowFlag(arena);
+    //Reveal the flag locations
+    int fid;
+    for (fid = 0; fid < adata->njuggers; fid++)
+        ShowFlag(arena, fid);
 
-    chat->SendArenaSoundMessage(arena, 104, "Juggernaut has started! The first person to get %i %s as the juggernaut wins!", adata->rkill, adata->rkill == 1 ? "kill" : "kills");
+    if (adata->rtime)
+    {
+        chat->SendArenaSoundMessage(arena, 104, "Juggernaut has started! Whoever is the juggernaut the longest in the next %i seconds wins!", adata->rtime);
+        if (adata->rkill)
+            chat->SendArenaMessage(arena, "Getting %i %s as the juggernaut wins outright.", adata->rkill, adata->rkill == 1 ? "kill" : "kills");
+
+        ml->SetTimer(TimeOver, adata->rtime * 100, adata->rtime * 100, arena, arena);
+        ml->SetTimer(Standings, STANDINGS_INTERVAL, STANDINGS_INTERVAL, arena, arena);
+    }
+    else
+        chat->SendArenaSoundMessage(arena, 104, "Juggernaut has started! The first person to get %i %s as the juggernaut wins!", adata->rkill, adata->rkill == 1 ? "kill" : "kills");
+
+    //radar, with the marker falling back on messages if objects aren't loaded
+    adata->radar = cfg->GetInt(arena->cfg, "Jugger", "Radar", 0);
+    if ((adata->radar == 2) && (!obj))
+        adata->radar = 1;
+    if (adata->radar)
+    {
+        int interval = cfg->GetInt(arena->cfg, "Jugger", "RadarInterval", 1000);
+        if (interval < 100)
+            interval = 100;
+        adata->radarobject = cfg->GetInt(arena->cfg, "Jugger", "RadarObject", 2000);
+        adata->radarnext = 0;
+        adata->radarshown = 0;
+        ml->SetTimer(RadarTick, interval, interval, arena, arena);
+    }
 
     //register callbacks
     mm->RegCallback(CB_KILL, Kill, arena);
@@ -382,27 +752,114 @@ local int TimeUp(void *p)
     return 0;
 }
 
+/* Put a player in the arena's set of humans */
+local void AddHuman(Arena *arena, Player *p)
+{
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+    Pdata *pdata = PPDATA(p, playerKey);
+
+    if (pdata->human || adata->nhumans >= JUGGER_MAX_PLAYERS)
+        return;
+
+    pdata->human = 1;
+    pdata->slot = adata->nhumans;
+    adata->humans[adata->nhumans++] = p;
+}
+
+/* Take a player out of it */
+local void RemoveHuman(Arena *arena, Player *p)
+{
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+    Pdata *pdata = PPDATA(p, playerKey);
+
+    if (!pdata->human)
+        return;
+
+    //fill the hole with the last human
+    Player *last = adata->humans[--adata->nhumans];
+    adata->humans[pdata->slot] = last;
+    ((Pdata*)PPDATA(last, playerKey))->slot = pdata->slot;
+    pdata->human = 0;
+}
+
+/* Empty the sets */
+local void ClearPlayers(Arena *arena)
+{
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+    int i;
+
+    for (i = 0; i < adata->nhumans; i++)
+        ((Pdata*)PPDATA(adata->humans[i], playerKey))->human = 0;
+    adata->nhumans = 0;
+
+    for (i = 0; i < JUGGER_MAX; i++)
+    {
+        if (adata->juggers[i])
+            ((Pdata*)PPDATA(adata->juggers[i], playerKey))->jugger = 0;
+        adata->juggers[i] = NULL;
+    }
+}
+
+/* Make a player the holder of a flag, or nobody if p is NULL */
+local void SetJugger(Arena *arena, int fid, Player *p)
+{
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+    Player *old = adata->juggers[fid];
+
+    if (old)
+        ((Pdata*)PPDATA(old, playerKey))->jugger = 0;
+    adata->juggers[fid] = p;
+    if (p)
+    {
+        RemoveHuman(arena, p);
+        ((Pdata*)PPDATA(p, playerKey))->jugger = fid + 1;
+    }
+}
+
+/* Take a flag from its holder and put it back on the map */
+local void FreeFlag(Arena *arena, int fid)
+{
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+    Player *old = adata->juggers[fid];
+
+    SetJugger(arena, fid, NULL);
+    if (old)
+    {
+        game->SetFreq(old, HUMAN_FREQ);
+        CheckShip(old);
+    }
+    ShowFlag(arena, fid);
+}
+
+/* A juggernaut has left the game: nobody holds their flag now */
+local void DropJugger(Arena *arena, Player *p)
+{
+    Pdata *pdata = PPDATA(p, playerKey);
+
+    if (pdata->jugger)
+        SetJugger(arena, pdata->jugger - 1, NULL);
+}
+
 /* Check if players have left the arena or specced. */
-local void LCheck(Arena *arena, Player *pe)
+local void LCheck(Arena *arena)
 {
-    Player *winner;
-    
-    Player *p;
-    Link *link;
-    int i = 0;
-    pd->Lock();
-    FOR_EACH_PLAYER(p)
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+    Player *winner = adata->nhumans ? adata->humans[0] : NULL;
+    int fid, i = adata->nhumans;
+
+    for (fid = 0; fid < adata->njuggers; fid++)
     {
-        if ((p->arena == arena) && (p->p_ship != SHIP_SPEC) && (p!=pe))
+        if (adata->juggers[fid])
         {
-            winner = p;
+            winner = adata->juggers[fid];
             i++;
         }
     }
-    pd->Unlock();
+
     if (i == 1)
     {
         chat->SendArenaSoundMessage(arena, 5, "Game Over! This round's winner is %s.", winner->name);
+        EndMatch(arena, winner);
         Stop(arena);
     }
     else if (i == 0)
@@ -421,78 +878,588 @@ local void Check(Player *p)
     if (!pdata->kills)
         pdata->kills = 0;
 
-    if (pdata->kills == adata->rkill)
+    if (adata->rkill && pdata->kills == adata->rkill)
     {
         chat->SendArenaSoundMessage(p->arena, 5, "Game over! %s was the fastest killer as juggernaut and is the juggernaut winner!", p->name);
+        EndMatch(p->arena, p);
         Stop(p->arena);
     }
 }
 
 /* Hide Flag */
-local void HideFlag(Arena *arena)
+local void HideFlag(Arena *arena, int fid)
 {
     FlagInfo fi;
-    flags->GetFlags(arena, 0, &fi, 1);
+    flags->GetFlags(arena, fid, &fi, 1);
     //fi.state = FI_NONE;
     if (fi.state == FI_CARRIED)
     {
         fi.state = FI_NONE;
         fi.carrier = NULL;
-        flags->SetFlags(arena, 0, &fi, 1);
+        flags->SetFlags(arena, fid, &fi, 1);
     }
     fi.carrier = NULL;
     fi.x = 100;
     fi.y = 100;
     fi.freq = -1;
-    flags->SetFlags(arena, 0, &fi, 1);
+    flags->SetFlags(arena, fid, &fi, 1);
 }
 
-/* Show Flag */
-local void ShowFlag(Arena *arena)
+/* Show Flag, on a random open tile of the spawn area */
+local void ShowFlag(Arena *arena, int fid)
 {
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
     FlagInfo fi;
-    flags->GetFlags(arena, 0, &fi, 1);
-    //fi.state = FI_NONE;
+    flags->GetFlags(arena, fid, &fi, 1);
+    fi.state = FI_ONMAP;
     fi.freq = -1;
     fi.carrier = NULL;
     
-    srand(time(NULL));
-    fi.x = rand() %225 + 400;
-    fi.y = rand() %200 + 425;
-    if (fi.y > 603)
-        fi.y = 440;
-    flags->SetFlags(arena, 0, &fi, 1);
+    if (adata->nspawns)
+    {
+        u32 tile = adata->spawns[Random(adata) % adata->nspawns];
+        fi.x = tile & 1023;
+        fi.y = tile >> 10;
+    }
+    else
+    {
+        //no open tiles were found, so fall back on the old area
+        fi.x = Random(adata) % 225 + 400;
+        fi.y = Random(adata) % 200 + 425;
+        if (fi.y > 603)
+            fi.y = 440;
+    }
+    flags->SetFlags(arena, fid, &fi, 1);
 }
 
 /* Transfer the flag to this player */
-local void TransferFlag(Player *p)
+local void TransferFlag(Player *p, int fid)
 {
     FlagInfo fi; 
-    flags->GetFlags(p->arena, 0, &fi, 1);
+    flags->GetFlags(p->arena, fid, &fi, 1);
     fi.state = FI_CARRIED;
     fi.carrier = p;
-    flags->SetFlags(p->arena, 0, &fi, 1); 
+    flags->SetFlags(p->arena, fid, &fi, 1); 
 }
 
-/* Check if players are on legal frequencies */
-local void CheckPlayers(Arena *arena)
+/* Is this tile one a flag may spawn on? */
+local int SpawnTile(Arena *arena, Region *rgn, int x, int y)
 {
-    Link *link;
-    Player *p;
-    pd->Lock();
-    FOR_EACH_PLAYER(p)
+    if (mapdata->GetTile(arena, x, y))
+        return 0;
+    return !rgn || mapdata->Contains(rgn, x, y);
+}
+
+/* Find the open tiles of the spawn area, keeping the largest connected
+ * patch of them. Each patch is flood filled into one queue in turn, so
+ * every tile is looked at a bounded number of times. */
+local void BuildSpawns(Arena *arena)
+{
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+    const char *name = cfg->GetStr(arena->cfg, "Jugger", "SpawnRegion");
+    Region *rgn = name ? mapdata->FindRegionByName(arena, name) : NULL;
+    int left = 0, top = 0, right = 1023, bottom = 1023;
+
+    if (!rgn)
     {
-        if (p->arena == arena)
+        left = cfg->GetInt(arena->cfg, "Jugger", "SpawnLeft", 400);
+        top = cfg->GetInt(arena->cfg, "Jugger", "SpawnTop", 425);
+        right = cfg->GetInt(arena->cfg, "Jugger", "SpawnRight", 625);
+        bottom = cfg->GetInt(arena->cfg, "Jugger", "SpawnBottom", 625);
+        if (left < 0) left = 0;
+        if (top < 0) top = 0;
+        if (right > 1023) right = 1023;
+        if (bottom > 1023) bottom = 1023;
+    }
+
+    free(adata->spawns);
+    adata->spawns = NULL;
+    adata->nspawns = 0;
+    if ((right < left) || (bottom < top))
+        return;
+
+    int w = right - left + 1, h = bottom - top + 1;
+    u8 *seen = calloc(w * h, sizeof(u8));
+    u32 *queue = malloc(w * h * sizeof(u32));
+    if (!seen || !queue)
+    {
+        free(seen);
+        free(queue);
+        return;
+    }
+
+    int x, y, start = 0, end = 0, best = 0, bestlen = 0;
+    for (y = top; y <= bottom; y++)
+    {
+        for (x = left; x <= right; x++)
         {
-            if ((p->p_freq != HUMAN_FREQ) && (p->p_freq != JUGGER_FREQ) && (p->p_ship != SHIP_SPEC))
+            if (seen[(y - top) * w + (x - left)] || !SpawnTile(arena, rgn, x, y))
+                continue;
+
+            //flood fill this patch
+            start = end;
+            seen[(y - top) * w + (x - left)] = 1;
+            queue[end++] = (y << 10) | x;
+
+            int i;
+            for (i = start; i < end; i++)
+            {
+                int tx = queue[i] & 1023, ty = queue[i] >> 10, d;
+                for (d = 0; d < 4; d++)
+                {
+                    int nx = tx + (d == 0) - (d == 1);
+                    int ny = ty + (d == 2) - (d == 3);
+                    if ((nx < left) || (nx > right) || (ny < top) || (ny > bottom))
+                        continue;
+                    if (seen[(ny - top) * w + (nx - left)] || !SpawnTile(arena, rgn, nx, ny))
+                        continue;
+                    seen[(ny - top) * w + (nx - left)] = 1;
+                    queue[end++] = (ny << 10) | nx;
+                }
+            }
+
+            if (end - start > bestlen)
             {
-                game->SetFreq(p, HUMAN_FREQ);
+                best = start;
+                bestlen = end - start;
             }
         }
     }
+    free(seen);
+
+    if (bestlen)
+    {
+        adata->spawns = malloc(bestlen * sizeof(u32));
+        if (adata->spawns)
+        {
+            memcpy(adata->spawns, queue + best, bestlen * sizeof(u32));
+            adata->nspawns = bestlen;
+        }
+    }
+    free(queue);
+}
+
+/* The arena's own xorshift generator, so flags don't share rand()'s state */
+local u32 Random(Adata *adata)
+{
+    u32 x = adata->seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    adata->seed = x;
+    return x;
+}
+
+/* Start counting a player's time as the juggernaut */
+local void StartReign(Player *p)
+{
+    Pdata *pdata = PPDATA(p, playerKey);
+    if (pdata->reigning)
+        return;
+
+    pdata->reigning = 1;
+    pdata->reignstart = current_ticks();
+    pdata->streak = 0;
+
+    MatchEntry *e = Entry(p);
+    if (e)
+        e->reigns++;
+}
+
+/* Stop counting it, adding the reign to their total */
+local void EndReign(Player *p)
+{
+    Pdata *pdata = PPDATA(p, playerKey);
+    if (!pdata->reigning)
+        return;
+
+    int reign = TICK_DIFF(current_ticks(), pdata->reignstart);
+    pdata->jtime += reign;
+    pdata->reigning = 0;
+
+    MatchEntry *e = Entry(p);
+    if (e)
+    {
+        e->reigntime += reign;
+        if (reign > e->longest)
+            e->longest = reign;
+    }
+}
+
+/* Ticks a player has spent as the juggernaut, including right now */
+local int ReignTime(Player *p)
+{
+    Pdata *pdata = PPDATA(p, playerKey);
+    int total = pdata->jtime;
+
+    if (pdata->reigning)
+        total += TICK_DIFF(current_ticks(), pdata->reignstart);
+    return total;
+}
+
+/* Find the players with the most time as the juggernaut, best first.
+ * Only those playing are candidates: the juggernauts, then everyone else. */
+local int TopReigns(Arena *arena, Player **top, int max)
+{
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+    int i, j, n = 0;
+
+    for (j = 0; j < adata->njuggers + adata->nhumans; j++)
+    {
+        Player *g = (j < adata->njuggers) ? adata->juggers[j] : adata->humans[j - adata->njuggers];
+        if ((!g) || (!ReignTime(g)))
+            continue;
+
+        if (n < max)
+            n++;
+        else if (ReignTime(g) <= ReignTime(top[n - 1]))
+            continue;
+
+        for (i = n - 1; (i > 0) && (ReignTime(g) > ReignTime(top[i - 1])); i--)
+            top[i] = top[i - 1];
+        top[i] = g;
+    }
+
+    return n;
+}
+
+/* Tell the arena who has been the juggernaut the longest */
+local int Standings(void *a)
+{
+    Arena *arena = a;
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+    if (adata->started != 2)
+        return 0;
+
+    Player *top[3];
+    int i, n = TopReigns(arena, top, 3);
+
+    for (i = 0; i < n; i++)
+        chat->SendArenaMessage(arena, "%i. %s - %i seconds as juggernaut", i + 1, top[i]->name, ReignTime(top[i]) / 100);
+
+    return 1;
+}
+
+/* A timed game has run its course */
+local int TimeOver(void *a)
+{
+    Arena *arena = a;
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+    if (adata->started != 2)
+        return 0;
+
+    Player *top[1];
+    int n = TopReigns(arena, top, 1);
+    if (n)
+        chat->SendArenaSoundMessage(arena, 5, "Time's up! %s was the juggernaut the longest, with %i seconds, and wins!",
+            top[0]->name, ReignTime(top[0]) / 100);
+    else
+        chat->SendArenaSoundMessage(arena, 5, "Time's up! Nobody became the juggernaut.");
+
+    EndMatch(arena, n ? top[0] : NULL);
+    Stop(arena);
+    return 0;
+}
+
+/* Show where one juggernaut is. Only one position is looked at per
+ * update, and it goes out as a single message or object change to the
+ * whole arena. With several juggernauts, updates take turns. */
+local int RadarTick(void *a)
+{
+    Arena *arena = a;
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+    if (adata->started != 2)
+        return 0;
+
+    int fid = adata->radarnext;
+    Player *j = adata->juggers[fid];
+    adata->radarnext = (fid + 1) % adata->njuggers;
+
+    Target target;
+    target.type = T_ARENA;
+    target.u.arena = arena;
+
+    if (adata->radar == 1)
+    {
+        if ((!j) || (j->p_ship == SHIP_SPEC))
+            return 1;
+
+        //the 20x20 grid players see on their radar: A-T across, 1-20 down
+        int col = (j->position.x >> 4) * 20 / 1024;
+        int row = (j->position.y >> 4) * 20 / 1024;
+        if (adata->njuggers > 1)
+            chat->SendArenaMessage(arena, "Radar: juggernaut %s is in %c%i.", j->name, 'A' + col, row + 1);
+        else
+            chat->SendArenaMessage(arena, "Radar: the juggernaut is in %c%i.", 'A' + col, row + 1);
+    }
+    else
+    {
+        int id = adata->radarobject + fid;
+        int shown = adata->radarshown & (1 << fid);
+
+        if ((!j) || (j->p_ship == SHIP_SPEC))
+        {
+            if (shown)
+            {
+                obj->Toggle(&target, id, 0);
+                adata->radarshown &= ~(1 << fid);
+            }
+            return 1;
+        }
+
+        obj->Move(&target, id, j->position.x, j->position.y, 0, 0);
+        if (!shown)
+        {
+            obj->Toggle(&target, id, 1);
+            adata->radarshown |= 1 << fid;
+        }
+    }
+
+    return 1;
+}
+
+/* Stop the radar and take down any markers it put up */
+local void ClearRadar(Arena *arena)
+{
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+    ml->ClearTimer(RadarTick, arena);
+
+    if ((adata->radar == 2) && (adata->radarshown))
+    {
+        short ids[JUGGER_MAX];
+        char ons[JUGGER_MAX];
+        int fid, count = 0;
+
+        for (fid = 0; fid < JUGGER_MAX; fid++)
+        {
+            if (adata->radarshown & (1 << fid))
+            {
+                ids[count] = adata->radarobject + fid;
+                ons[count++] = 0;
+            }
+        }
+
+        Target target;
+        target.type = T_ARENA;
+        target.u.arena = arena;
+        obj->ToggleSet(&target, ids, ons, count);
+    }
+    adata->radar = 0;
+    adata->radarshown = 0;
+}
+
+/* A player's line in the record of the current game. Players who leave
+ * and come back are found again by name. */
+local MatchEntry *Entry(Player *p)
+{
+    Adata *adata = P_ARENA_DATA(p->arena, arenaKey);
+    Pdata *pdata = PPDATA(p, playerKey);
+
+    if (adata->started != 2)
+        return NULL;
+    if (pdata->entry)
+        return &adata->entries[pdata->entry - 1];
+
+    int i;
+    for (i = 0; i < adata->nentries; i++)
+    {
+        if (!strcmp(adata->entries[i].name, p->name))
+        {
+            pdata->entry = i + 1;
+            return &adata->entries[i];
+        }
+    }
+
+    if (adata->nentries == adata->maxentries)
+    {
+        int max = adata->maxentries ? adata->maxentries * 2 : 32;
+        MatchEntry *entries = realloc(adata->entries, max * sizeof(MatchEntry));
+        if (!entries)
+            return NULL;
+        adata->entries = entries;
+        adata->maxentries = max;
+    }
+
+    MatchEntry *e = &adata->entries[adata->nentries++];
+    memset(e, 0, sizeof(MatchEntry));
+    astrncpy(e->name, p->name, sizeof(e->name));
+    pdata->entry = adata->nentries;
+    return e;
+}
+
+/* Note a flag changing hands */
+local void AddHandoff(Arena *arena, int fid, Player *from, Player *to, int how)
+{
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+
+    if (adata->nhandoffs == adata->maxhandoffs)
+    {
+        int max = adata->maxhandoffs ? adata->maxhandoffs * 2 : 64;
+        Handoff *handoffs = realloc(adata->handoffs, max * sizeof(Handoff));
+        if (!handoffs)
+            return;
+        adata->handoffs = handoffs;
+        adata->maxhandoffs = max;
+    }
+
+    Handoff *h = &adata->handoffs[adata->nhandoffs++];
+    h->time = TICK_DIFF(current_ticks(), adata->matchstart);
+    h->flag = fid;
+    h->how = how;
+    astrncpy(h->from, from ? from->name : "", sizeof(h->from));
+    astrncpy(h->to, to->name, sizeof(h->to));
+}
+
+/* A game has been won: finish the record and save it */
+local void EndMatch(Arena *arena, Player *winner)
+{
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+    int fid;
+
+    //reigns still running count up to now
+    for (fid = 0; fid < adata->njuggers; fid++)
+        if (adata->juggers[fid])
+            EndReign(adata->juggers[fid]);
+
+    if (winner)
+    {
+        MatchEntry *e = Entry(winner);
+        if (e)
+            e->won = 1;
+    }
+
+    if (db)
+        SaveMatch(arena, winner);
+}
+
+/* Write the record of a game in one transaction: the match, then every
+ * handoff and player in one multi-row insert each. Every statement is
+ * queued here in one go, so they run back to back on the one connection
+ * with nothing in between, and LAST_INSERT_ID() is the match's id. The
+ * callbacks only note failures (see Saved). */
+local void SaveMatch(Arena *arena, Player *winner)
+{
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+    MatchEntry *longest = NULL, *streak = NULL;
+    int i;
+
+    for (i = 0; i < adata->nentries; i++)
+    {
+        MatchEntry *e = &adata->entries[i];
+        if (!longest || e->longest > longest->longest)
+            longest = e;
+        if (!streak || e->beststreak > streak->beststreak)
+            streak = e;
+    }
+
+    MatchSave *save = calloc(1, sizeof(MatchSave));
+    if (!save)
+        return;
+
+    //each row needs at most two hex-encoded names and five numbers
+    int len = 128 + (adata->nhandoffs + adata->nentries) * (4 * 24 + 96);
+    char *handoffs = adata->nhandoffs ? malloc(len) : NULL;
+    char *players = adata->nentries ? malloc(len) : NULL;
+    int pos;
+
+    if ((adata->nhandoffs && !handoffs) || (adata->nentries && !players))
+    {
+        free(handoffs);
+        free(players);
+        free(save);
+        return;
+    }
+
+    if (handoffs)
+    {
+        pos = snprintf(handoffs, len,
+            "INSERT INTO `juggerhandoffs` (`matchid`, `seq`, `time`, `flag`, `how`, `oldname`, `newname`) VALUES");
+        for (i = 0; i < adata->nhandoffs; i++)
+        {
+            Handoff *h = &adata->handoffs[i];
+            pos += snprintf(handoffs + pos, len - pos, "%s(@juggermatch,%d,%d,%d,%d,",
+                i ? "," : "", i, h->time / 100, h->flag, h->how);
+            pos = AppendHex(handoffs, pos, len, h->from);
+            pos += snprintf(handoffs + pos, len - pos, ",");
+            pos = AppendHex(handoffs, pos, len, h->to);
+            pos += snprintf(handoffs + pos, len - pos, ")");
+        }
+        snprintf(handoffs + pos, len - pos, ";");
+    }
+
+    if (players)
+    {
+        pos = snprintf(players, len,
+            "INSERT INTO `juggerplayers` (`matchid`, `arena`, `name`, `won`, `kills`, `reigns`,"
+            " `reigntime`, `longestreign`, `beststreak`) VALUES");
+        for (i = 0; i < adata->nentries; i++)
+        {
+            MatchEntry *e = &adata->entries[i];
+            pos += snprintf(players + pos, len - pos, "%s(@juggermatch,", i ? "," : "");
+            pos = AppendHex(players, pos, len, arena->basename);
+            pos += snprintf(players + pos, len - pos, ",");
+            pos = AppendHex(players, pos, len, e->name);
+            pos += snprintf(players + pos, len - pos, ",%d,%d,%d,%d,%d,%d)",
+                e->won, e->kills, e->reigns, e->reigntime / 100, e->longest / 100, e->beststreak);
+        }
+        snprintf(players + pos, len - pos, ";");
+    }
+
+    //everything from here to COMMIT is queued without waiting on a reply
+    save->pending = 5 + (handoffs ? 1 : 0) + (players ? 1 : 0);
+    db->Query(db_save, save, 1, "START TRANSACTION;");
+    db->Query(db_save, save, 1, INSERT_MATCH, arena->basename,
+        (unsigned int)(TICK_DIFF(current_ticks(), adata->matchstart) / 100),
+        (unsigned int)adata->njuggers, winner ? winner->name : "",
+        (unsigned int)adata->nhandoffs,
+        (unsigned int)(longest ? longest->longest / 100 : 0), longest ? longest->name : "",
+        (unsigned int)(streak ? streak->beststreak : 0), streak ? streak->name : "");
+    db->Query(db_save, save, 1, SET_MATCHID);
+    db->Query(db_savedid, save, 1, "SELECT @juggermatch;");
+    if (handoffs)
+        db->Query(db_save, save, 1, handoffs);
+    if (players)
+        db->Query(db_save, save, 1, players);
+    db->Query(db_save, save, 1, "COMMIT;");
+    free(handoffs);
+    free(players);
+
+    /* Fold the game into the summaries of those still here */
+    Player *g;
+    Link *link;
+    pd->Lock();
+    FOR_EACH_PLAYER(g)
+    {
+        Pdata *pdata = PPDATA(g, playerKey);
+        if ((g->arena != arena) || (!pdata->entry) || (!pdata->statsloaded))
+            continue;
+
+        MatchEntry *e = &adata->entries[pdata->entry - 1];
+        pdata->games++;
+        pdata->wins += e->won;
+        pdata->totalkills += e->kills;
+        pdata->totaltime += e->reigntime / 100;
+        if (e->beststreak > pdata->beststreak)
+            pdata->beststreak = e->beststreak;
+        if (e->longest / 100 > pdata->longestreign)
+            pdata->longestreign = e->longest / 100;
+    }
     pd->Unlock();
 }
 
+/* Throw away the record of a game */
+local void ClearMatch(Arena *arena)
+{
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+
+    free(adata->entries);
+    adata->entries = NULL;
+    adata->nentries = adata->maxentries = 0;
+    free(adata->handoffs);
+    adata->handoffs = NULL;
+    adata->nhandoffs = adata->maxhandoffs = 0;
+}
+
 /* End the current game */
 local void Stop(Arena* arena)
 {
@@ -512,6 +1479,9 @@ local void Stop(Arena* arena)
             
             Pdata *pdata = PPDATA(p, playerKey);
             pdata->kills = 0;
+            pdata->reigning = 0;
+            pdata->jtime = 0;
+            pdata->entry = 0;
         }
     }
     pd->Unlock();
@@ -520,10 +1490,17 @@ local void Stop(Arena* arena)
     Adata *adata = P_ARENA_DATA(arena, arenaKey);
     adata->started = 0;
     adata->rkill = 0;
+    adata->rtime = 0;
     adata->lockships = 0;
+    ClearPlayers(arena);
+    ClearMatch(arena);
+    adata->njuggers = 1;
 
     /* Clear timers and unregister callbacks */
     ml->ClearTimer(TimeUp, arena);
+    ml->ClearTimer(TimeOver, arena);
+    ml->ClearTimer(Standings, arena);
+    ClearRadar(arena);
     mm->UnregCallback(CB_KILL, Kill, arena);
     mm->UnregCallback(CB_PLAYERACTION, PlayerAction, arena);
     mm->UnregCallback(CB_SHIPFREQCHANGE, ShipFreqChange, arena);
@@ -538,61 +1515,100 @@ local void Stop(Arena* arena)
 /* Add to juggernaut's kills, or change juggernaut. */
 local void Kill(Arena *arena, Player *k, Player *p, int bounty, int flags, int pts, int green)
 {
-    CheckPlayers(arena);
-    
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+    Pdata *kdata = PPDATA(k, playerKey);
+    Pdata *pdata = PPDATA(p, playerKey);
+
     /* IF JUGGER */
-    if (k->p_freq == JUGGER_FREQ)
+    if (kdata->jugger)
     {
         /* Let's add to the number of kills the juggernaut has. */
-        Pdata *pdata = PPDATA(k, playerKey);
-        
-        if (!pdata->kills)
-            pdata->kills = 0;
-        
-        pdata->kills++;
+        kdata->kills++;
+        kdata->streak++;
+
+        MatchEntry *e = Entry(k);
+        if (e)
+        {
+            e->kills++;
+            if (kdata->streak > e->beststreak)
+                e->beststreak = kdata->streak;
+        }
+
+        //a juggernaut killed by another one loses their flag to the map
+        if (pdata->jugger)
+            FreeFlag(arena, pdata->jugger - 1);
 
         Check(k);
     }
     /* IF HUMAN */
-    else if (k->p_freq == HUMAN_FREQ)
+    else if (pdata->jugger)
     {
-        game->SetFreq(k, JUGGER_FREQ);
+        int fid = pdata->jugger - 1;
+
+        //the sets change first, so the freq changes below find them right
+        AddHandoff(arena, fid, p, k, 1);
+        SetJugger(arena, fid, k);
+        game->SetFreq(k, JUGGER_FREQ + fid);
         game->SetFreq(p, HUMAN_FREQ);
-        CheckLegalShip(arena);
+        CheckShip(k);
+        CheckShip(p);
         
-        TransferFlag(k);
+        TransferFlag(k, fid);
         
         /* Announce the new juggernaut. */
-        Pdata *pdata = PPDATA(k, playerKey);
-        Adata *adata = P_ARENA_DATA(k->arena, arenaKey);
-        
-        int left = adata->rkill - pdata->kills;
-        chat->SendArenaSoundMessage(p->arena, 2, "%s just killed the juggernaut and is now the new juggernaut!", k->name);
-        chat->SendArenaSoundMessage(p->arena, 2, "%s only needs %i more %s to win!", k->name, left, left == 1 ? "kill" : "kills");
+        int left = adata->rkill - kdata->kills;
+        if (adata->njuggers > 1)
+            chat->SendArenaSoundMessage(p->arena, 2, "%s just killed juggernaut %s and is now a juggernaut!", k->name, p->name);
+        else
+            chat->SendArenaSoundMessage(p->arena, 2, "%s just killed the juggernaut and is now the new juggernaut!", k->name);
+        if (adata->rkill)
+            chat->SendArenaSoundMessage(p->arena, 2, "%s only needs %i more %s to win!", k->name, left, left == 1 ? "kill" : "kills");
         Check(k);
     }
 }
 
-/* Check if a player spectates the game. */
+/* Check if a player spectates the game. Only the player who changed
+ * is looked at: the sets say who belongs where. */
 local void ShipFreqChange(Player *p, int newship, int oldship, int newfreq, int oldfreq)
 {
-    CheckPlayers(p->arena);
     Adata *adata = P_ARENA_DATA(p->arena, arenaKey);
+    Pdata *pdata = PPDATA(p, playerKey);
+    int fid = pdata->jugger - 1;
+
+    /* Being on a juggernaut's freq, in a ship, is what counts as time */
+    if ((pdata->jugger) && (p->p_freq == JUGGER_FREQ + fid) && (p->p_ship != SHIP_SPEC))
+        StartReign(p);
+    else
+        EndReign(p);
     
     if (p->p_ship == SHIP_SPEC)
     {
-        LCheck(p->arena, p);
+        RemoveHuman(p->arena, p);
+        DropJugger(p->arena, p);
+        LCheck(p->arena);
     }
-    else if (p->p_freq == JUGGER_FREQ)
+    else if (pdata->jugger)
     {
+        if (p->p_freq != JUGGER_FREQ + fid)
+        {
+            game->SetFreq(p, JUGGER_FREQ + fid);
+            return;
+        }
         if ((adata->jlockship) && (p->p_ship != adata->jship))
         {
             game->SetShip(p, adata->jship);
-            TransferFlag(p);
+            TransferFlag(p, fid);
         }
     }
     else
     {
+        AddHuman(p->arena, p);
+        if (p->p_freq != HUMAN_FREQ)
+        {
+            game->SetFreq(p, HUMAN_FREQ);
+            return;
+        }
+
         if (!adata->lockships)
             return;
 
@@ -605,11 +1621,7 @@ local void ShipFreqChange(Player *p, int newship, int oldship, int newfreq, int
         if (!legal)
         {
             if (oldship == SHIP_SPEC)
-            {
-                Adata *adata = P_ARENA_DATA(p->arena, arenaKey);
-                int defaultship = adata->defaultship;
-                game->SetShip(p, defaultship);
-            }
+                game->SetShip(p, adata->defaultship);
             else
                 game->SetShip(p, oldship);
         }
@@ -621,11 +1633,13 @@ local void PlayerAction(Player *p, int action, Arena *arena)
 {
     if (!p->arena)
         return;
-    //CheckPlayers(arena);
     
     if ((action == PA_DISCONNECT) || (action == PA_LEAVEARENA))
     {
-        LCheck(arena, p);
+        EndReign(p);
+        RemoveHuman(arena, p);
+        DropJugger(arena, p);
+        LCheck(arena);
     }
     
     /* Send a new player the status of the game. */
@@ -640,46 +1654,85 @@ local void PlayerAction(Player *p, int action, Arena *arena)
             
             Adata *adata = P_ARENA_DATA(p->arena, arenaKey);
             pdata->kills = 0;
-            chat->SendSoundMessage(p, 26, "We are playing Jugger to %i %s.", adata->rkill, adata->rkill == 1 ? "kill" : "kills");
+            pdata->reigning = 0;
+            pdata->jtime = 0;
+            pdata->entry = 0;
+
+            //someone coming back to a running game keeps their time as the juggernaut
+            int i;
+            for (i = 0; (adata->started == 2) && (i < adata->nentries); i++)
+            {
+                if (!strcmp(adata->entries[i].name, p->name))
+                {
+                    pdata->entry = i + 1;
+                    pdata->jtime = adata->entries[i].reigntime;
+                }
+            }
+            if (adata->rtime)
+                chat->SendSoundMessage(p, 26, "We are playing timed Jugger: longest time as the juggernaut in %i seconds wins.", adata->rtime);
+            else
+                chat->SendSoundMessage(p, 26, "We are playing Jugger to %i %s.", adata->rkill, adata->rkill == 1 ? "kill" : "kills");
         }
     }
 }
 
 /* Handling flag loss */
-local void Flaglost(Arena *arena, Player *p)
+local void Flaglost(Arena *arena, Player *p, int fid, int how)
 {
+    //whoever drops the flag stops being timed, even before their freq changes
+    EndReign(p);
 }
 
 /* Handling flag gain */
-local void Flaggain(Arena *arena, Player *p)
+local void Flaggain(Arena *arena, Player *p, int fid, int how)
 {
-    if (p->p_freq != JUGGER_FREQ)
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+    Pdata *pdata = PPDATA(p, playerKey);
+
+    if (fid >= adata->njuggers)
+        return;
+
+    /* A juggernaut only carries their own flag; put a second one back */
+    if ((pdata->jugger) && (pdata->jugger != fid + 1))
     {
-        Link *link;
-        Player *g;
-        pd->Lock();
-        FOR_EACH_PLAYER(g)
+        FreeFlag(arena, fid);
+        return;
+    }
+
+    if (adata->juggers[fid] != p)
+    {
+        Player *old = adata->juggers[fid];
+
+        AddHandoff(arena, fid, old, p, 0);
+        SetJugger(arena, fid, p);
+        if (old)
         {
-            if ((g->arena == arena) && (g->p_freq == JUGGER_FREQ))
-            {
-                game->SetFreq(g, HUMAN_FREQ); //put the former juggernaut on human freq
-            }
+            game->SetFreq(old, HUMAN_FREQ); //put the former juggernaut on human freq
+            CheckShip(old);
         }
-        pd->Unlock();
-        game->SetFreq(p, JUGGER_FREQ);
-        CheckLegalShip(arena);
-        TransferFlag(p);
+        game->SetFreq(p, JUGGER_FREQ + fid);
+        StartReign(p);
+        CheckShip(p);
+        TransferFlag(p, fid);
         
-        Pdata *pdata = PPDATA(p, playerKey);
-        Adata *adata = P_ARENA_DATA(p->arena, arenaKey);
-
         int left = adata->rkill - pdata->kills;
-        chat->SendArenaSoundMessage(p->arena, 2, "%s found the flag and is now the new Juggernaut!", p->name);
-        chat->SendArenaSoundMessage(p->arena, 2, "%s only needs %i more %s to win!", p->name, left, left == 1 ? "kill" : "kills");
+        if (adata->njuggers > 1)
+            chat->SendArenaSoundMessage(p->arena, 2, "%s found a flag and is now a Juggernaut!", p->name);
+        else
+            chat->SendArenaSoundMessage(p->arena, 2, "%s found the flag and is now the new Juggernaut!", p->name);
+        if (adata->rkill)
+            chat->SendArenaSoundMessage(p->arena, 2, "%s only needs %i more %s to win!", p->name, left, left == 1 ? "kill" : "kills");
         Check(p);
     }
 }
 
+/* Load a player's past games when they enter the arena */
+local void StatsAction(Player *p, int action, Arena *arena)
+{
+    if ((action == PA_ENTERARENA) && (p->arena == arena))
+        LoadSummary(p);
+}
+
 /************************************************************************/
 /*                          Player Commands                             */
 /************************************************************************/
@@ -722,9 +1775,13 @@ local void cHost(const char *command, const char *params, Player *p, const Targe
         chat->SendMessage(p, "| Jugger | Who will be the juggernaught to rule them all?         |");
         chat->SendMessage(p, "-------------------------------------------------------------------");
         chat->SendMessage(p, "Parameters: kills: -k(#)");
+        chat->SendMessage(p, "    time, in secs: -t(#)");
         chat->SendMessage(p, "            ships: -s(#)");
         chat->SendMessage(p, "      jugger ship: -j(#)");
+        chat->SendMessage(p, "      juggernauts: -n(#)");
         chat->SendMessage(p, "Example: ?start jugger -k(5) -s(1,2,3) -j(1)");
+        chat->SendMessage(p, "         ?start jugger -t(300)");
+        chat->SendMessage(p, "         ?start jugger -k(10) -n(3)");
     }
     else
     {
@@ -765,6 +1822,42 @@ local void cRules(const char *command, const char *params, Player *p, const Targ
     chat->SendMessage(p, "Who will be the juggernaught to rule them all?");
 }
 
+/* ?juggerstats help information */
+local helptext_t juggerstats_help =
+"Targets: none or player\n"
+"Args: none\n"
+"Shows your record in this arena's jugger games, or that of the player\n"
+"you send it to.\n";
+
+/* ?juggerstats */
+local void cJuggerStats(const char *command, const char *params, Player *p, const Target *target)
+{
+    Player *t = (target->type == T_PLAYER) ? target->u.p : p;
+    Pdata *pdata = PPDATA(t, playerKey);
+
+    if (!db)
+    {
+        chat->SendMessage(p, "Jugger games are not recorded here.");
+        return;
+    }
+    if (!pdata->statsloaded)
+    {
+        chat->SendMessage(p, "%s's jugger record is still being loaded.", t->name);
+        return;
+    }
+    if (!pdata->games)
+    {
+        chat->SendMessage(p, "%s has not finished a game of jugger here.", t->name);
+        return;
+    }
+
+    chat->SendMessage(p, "%s: %i %s, %i %s, %i kills as juggernaut (best streak %i).",
+        t->name, pdata->games, pdata->games == 1 ? "game" : "games",
+        pdata->wins, pdata->wins == 1 ? "win" : "wins", pdata->totalkills, pdata->beststreak);
+    chat->SendMessage(p, "%i seconds as juggernaut in all, longest reign %i seconds.",
+        pdata->totaltime, pdata->longestreign);
+}
+
 /************************************************************************/
 /*                            Module Init                               */
 /************************************************************************/
@@ -787,21 +1880,29 @@ EXPORT int MM_jugger(int action, Imodman *mm_, Arena *arena)
 
         aman = mm->GetInterface(I_ARENAMAN, arena);
         capman = mm->GetInterface(I_CAPMAN, arena);
+        cfg = mm->GetInterface(I_CONFIG, arena);
         chat = mm->GetInterface(I_CHAT, arena);
         cmd = mm->GetInterface(I_CMDMAN, arena);
         flags = mm->GetInterface(I_FLAGCORE, arena);
         game = mm->GetInterface(I_GAME, arena);
         ml = mm->GetInterface(I_MAINLOOP, arena);
+        mapdata = mm->GetInterface(I_MAPDATA, arena);
         pd = mm->GetInterface(I_PLAYERDATA, arena);
+        db = mm->GetInterface(I_RELDB, arena); //optional: games are only recorded with it
+        obj = mm->GetInterface(I_OBJECTS, arena); //optional: only the radar's marker needs it
 
-        if (!aman || !chat || !cmd || !flags || !game || !ml || !pd)
+        if (!aman || !cfg || !chat || !cmd || !flags || !game || !ml || !mapdata || !pd)
         {
+            mm->ReleaseInterface(obj);
+            mm->ReleaseInterface(db);
             mm->ReleaseInterface(pd);
+            mm->ReleaseInterface(mapdata);
             mm->ReleaseInterface(ml);
             mm->ReleaseInterface(game);
             mm->ReleaseInterface(flags);
             mm->ReleaseInterface(cmd);
             mm->ReleaseInterface(chat);
+            mm->ReleaseInterface(cfg);
             mm->ReleaseInterface(capman);
             mm->ReleaseInterface(aman);
             return MM_FAIL;
@@ -813,23 +1914,37 @@ EXPORT int MM_jugger(int action, Imodman *mm_, Arena *arena)
 
             if ((!playerKey)  || (!arenaKey))
             {
+                mm->ReleaseInterface(obj);
+                mm->ReleaseInterface(db);
                 mm->ReleaseInterface(pd);
+                mm->ReleaseInterface(mapdata);
                 mm->ReleaseInterface(ml);
                 mm->ReleaseInterface(game);
                 mm->ReleaseInterface(flags);
                 mm->ReleaseInterface(cmd);
                 mm->ReleaseInterface(chat);
+                mm->ReleaseInterface(cfg);
                 mm->ReleaseInterface(capman);
                 mm->ReleaseInterface(aman);
                 return MM_FAIL;
             }
             else
             {
+                Adata *adata = P_ARENA_DATA(arena, arenaKey);
+                adata->seed = current_millis() | 1;
+                adata->spawns = NULL;
+                adata->nspawns = 0;
+
+                if (db)
+                    init_db();
+                mm->RegCallback(CB_PLAYERACTION, StatsAction, arena);
+
                 cmd->AddCommand("host", cHost, arena, host_help);
                 cmd->AddCommand("start", cHost, arena, host_help);
                 cmd->AddCommand("stopevent", cStopEvent, arena, stop_help);
                 cmd->AddCommand("stop", cStopEvent, arena, stop_help);
                 cmd->AddCommand("rules", cRules, arena, rules_help);
+                cmd->AddCommand("juggerstats", cJuggerStats, arena, juggerstats_help);
 
                 return MM_OK;
             }
@@ -837,21 +1952,38 @@ EXPORT int MM_jugger(int action, Imodman *mm_, Arena *arena)
     }
     else if (action == MM_DETACH)
     {
+        Adata *adata = P_ARENA_DATA(arena, arenaKey);
+        free(adata->spawns);
+        adata->spawns = NULL;
+        adata->nspawns = 0;
+        ClearMatch(arena);
+
+        mm->UnregCallback(CB_PLAYERACTION, StatsAction, arena);
+
         pd->FreePlayerData(playerKey);
         aman->FreeArenaData(arenaKey);
 
+        ml->ClearTimer(TimeOver, arena);
+        ml->ClearTimer(Standings, arena);
+        ml->ClearTimer(RadarTick, arena);
+
+        cmd->RemoveCommand("juggerstats", cJuggerStats, arena);
         cmd->RemoveCommand("rules", cRules, arena);
         cmd->RemoveCommand("stop", cStopEvent, arena);
         cmd->RemoveCommand("stopevent", cStopEvent, arena);
         cmd->RemoveCommand("start", cHost, arena);
         cmd->RemoveCommand("host", cHost, arena);
 
+        mm->ReleaseInterface(obj);
+        mm->ReleaseInterface(db);
         mm->ReleaseInterface(pd);
+        mm->ReleaseInterface(mapdata);
         mm->ReleaseInterface(ml);
         mm->ReleaseInterface(game);
         mm->ReleaseInterface(flags);
         mm->ReleaseInterface(cmd);
         mm->ReleaseInterface(chat);
+        mm->ReleaseInterface(cfg);
         mm->ReleaseInterface(capman);
         mm->ReleaseInterface(aman);
 
@@ -5,14 +5,54 @@
  *  powerball) event for Devastation.
  *
  * Two goals, two teams. First team to get X amount of goals wins.
+ * With -t, the game also ends after that many minutes, won by whoever
+ * leads; if teams are tied, sudden death overtime runs until one
+ * team scores its way ahead of all the others. With -n, more than two
+ * teams (freqs 0 to N-1) play.
  *
  * Requirements:
- *  The map must have a goal on each side of the map.
- *  The arena must be configured to have two teams with opposing goals.
+ *  The map must have a goal for each team.
+ *  The arena must be configured to have as many teams, with opposing goals.
+ *
+ * When the game starts, the players in ships are split into teams of
+ * near equal total skill rating, kept in the pbratings table. Players
+ * without a rating count as 1500. Without a database everyone does.
+ *
+ * Ratings are Elo, by team: when a game is won, each player moves by
+ * K * G * (result - expected) against every other team, averaged, where
+ * expected comes from the teams' average ratings and G grows with the
+ * goal difference. Each goal scored also earns a bonus, which the
+ * players of the losing teams pay for in equal shares. All ratings are
+ * written back at once.
+ *
+ * During the game every player gets a roster slot, kept if they leave
+ * and come back, holding their goals, assists, kills, deaths and time
+ * carrying a ball. An assist goes to the last teammate to touch the
+ * ball before the scorer. The roster is printed when the game ends and
+ * appended to the match log; nothing is written while play goes on.
+ *
+ * Possession is kept as it happens: a team controls a ball from the
+ * moment one of its players picks it up until the other team does, or
+ * a goal is scored. Each ball event closes at most one interval, so the
+ * live share (?possession) and longest spell never need the history.
  *
  * To start the event, a moderator just needs to type ?start paintball
  * (some options are available). Typing ?stop will cancel the event.
  *
+ * Arena settings:
+ *
+ * [ Paintball ]
+ *  Balance = 1
+ *  ; 1 = rebalance the teams by rating when the game starts (default 1)
+ *  RatingK = 32
+ *  ; most a rating can move in a one goal game (default 32)
+ *  GoalBonus = 2
+ *  ; rating points for each goal a player scores, taken from the
+ *  ; losing teams (default 2)
+ *  MatchLog = paintball-matches.log
+ *  ; file each game's summary is appended to, empty = none
+ *  ; (default paintball-matches.log)
+ *
  * Based on a plugin originally designed by user XDOOM for
  * Deva-bot, recreated by Zachary Read for the ASSS server.
  *
@@ -20,30 +60,75 @@
 
 #include "asss.h"
 #include "clientset.h"
+#include "reldb.h"
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <math.h>
+#include <time.h>
+
+#include "sqlhex.h"
+
+#define DEFAULT_RATING 1500
+#define MAX_BALANCE 256     //most players the balancer will sort into teams
+#define MAX_ROSTER 128      //most players a game keeps statistics for
+#define MAX_TEAMS 8         //most teams a game can have, on freqs 0 to MAX_TEAMS-1
 
 /* Player data */
 typedef struct Pdata
 {
-    int score;
-    int kills;
-    int deaths;
+    int score;         //goals this game
+    int kills;         //kills this game
+    int deaths;        //deaths this game
+    int rating;        //skill rating, loaded on entry
+    int ratingloaded;  //1 = rating is settled: loaded, or set by a game
+    int slot;          //roster slot + 1 in the current game, 0 = none yet
 } Pdata;
 
 local int playerKey;
 
+/* Statistics of the current game, one entry per roster slot */
+typedef struct Roster
+{
+    int n;
+    char name[MAX_ROSTER][24];
+    int freq[MAX_ROSTER];       //freq they last played on
+    int rating[MAX_ROSTER];     //their rating, as of the last time they played
+    int goals[MAX_ROSTER];
+    int assists[MAX_ROSTER];
+    int kills[MAX_ROSTER];
+    int deaths[MAX_ROSTER];
+    int possession[MAX_ROSTER]; //ticks spent carrying a ball
+    int longestcarry[MAX_ROSTER]; //longest they carried a ball at once, in ticks
+} Roster;
+
 /* Arena data */
 typedef struct Adata
 {
-    int blue;          //blue team has this many goals
-    int green;         //green team has this many goals
-    int goals;         //number of goals a team needs to win
+    int score[MAX_TEAMS]; //goals of each team, by freq
+    int nteams;        //teams playing, on freqs 0 to nteams-1
+    int goals;         //number of goals a team needs to win, 0 = no limit
+    int minutes;       //length of the game, 0 = no time limit
+    int overtime;      //1 = sudden death: the first team to lead wins
     int lockships;     //0 = no, 1 = ships are restricted
     int started;       //0 = no game, 1 = pending, 2 = started
     int defaultship;   //this is the default ship if someone happens to change to a restricted ship
+    int winner;        //freq that won, -1 = no winner (yet)
+    int doors;         //door mode last pushed to the arena, -1 = none yet
+    LinkedList players; //everyone in the arena, kept by the arena's own callback
+
+    Roster roster;
+    ticks_t matchstart;
+    int touch[MAXBALLS][2];      //slots of the last two to touch each ball, -1 = none
+    int carrier[MAXBALLS];       //slot carrying each ball, -1 = none
+    ticks_t carried[MAXBALLS];   //when they picked it up
+
+    /* Team possession: closed intervals are summed, open ones are one per ball */
+    int control[MAXBALLS];       //freq controlling each ball, -1 = none
+    ticks_t controlsince[MAXBALLS];
+    int teamposs[MAX_TEAMS];     //ticks of closed possession by freq
+    int longestposs[MAX_TEAMS];  //longest closed possession by freq, in ticks
 } Adata;
 
 local int arenaKey;
@@ -60,9 +145,26 @@ local Iclientset *cs;
 local Igame *game;
 local Imainloop *ml;
 local Iplayerdata *pd;
+local Ireldb *db;
 
 local override_key_t ok_Doors;
 
+#define CREATE_RATINGS_TABLE \
+" CREATE TABLE IF NOT EXISTS `pbratings` (" \
+"  `name` varchar(24) NOT NULL default ''," \
+"  `rating` int(11) NOT NULL default '1500'," \
+"  `games` int(11) NOT NULL default '0'," \
+"  `date` timestamp NOT NULL," \
+"  PRIMARY KEY  (`name`)," \
+"  KEY `rating` (`rating`)" \
+");"
+
+#define SELECT_RATING \
+"SELECT `rating` FROM `pbratings` WHERE `name`=?;"
+
+#define SELECT_TOP_RATINGS \
+"SELECT `name`, `rating`, `games` FROM `pbratings` ORDER BY `rating` DESC LIMIT 10;"
+
 local int allships[7];
 
 /************************************************************************/
@@ -72,19 +174,118 @@ local int allships[7];
 //interface functions
 local char* getOption(const char *string, char param);
 
+//database
+local void init_db(void);
+local void db_rating(int status, db_res *res, void *clos);
+local void LoadRating(Player *p);
+local void db_top(int status, db_res *res, void *clos);
+
 //game functions
 local void Abort(Arena *arena, Player *host, int debug);
 local void Begin(Player *host, Arena *arena, const char *params);
 local void LegalShip(int ship, Arena *arena);
 local void CheckLegalShip(Arena *arena);
-local int TimeUp(void *p);
+local int TimeUp(void *a);
 local void LCheck(Arena *arena, Player *pe);
+local void SetDoors(Arena *arena, int mode);
+local void WarpAll(Arena *arena);
+local void Balance(Arena *arena);
+local void Rate(Arena *arena);
+local const char *TeamName(int freq);
+local void ShowScore(Arena *arena);
+local void Win(Arena *arena, int freq);
+local int TimeLimit(void *a);
+local int Slot(Player *p);
+local void ResetRoster(Arena *arena);
+local void Release(Arena *arena, int bid);
+local void TakeControl(Arena *arena, int bid, int freq);
+local void EndControl(Arena *arena, int bid);
+local int TeamPossession(Arena *arena, int freq);
+local int LongestPossession(Arena *arena, int freq);
+local void Summary(Arena *arena);
 local void Stop(Arena* arena);
 
 //callbacks
 local void ShipFreqChange(Player *p, int newship, int oldship, int newfreq, int oldfreq);
 local void PlayerAction(Player *p, int action, Arena *arena);
 local void Check(Arena *arena, Player *p, int bid, int x, int y);
+local void Kill(Arena *arena, Player *k, Player *p, int bounty, int flags, int pts, int green);
+local void BallPickup(Arena *arena, Player *p, int bid);
+local void BallFire(Arena *arena, Player *p, int bid);
+local void Membership(Player *p, int action, Arena *arena);
+
+/************************************************************************/
+/*                   Main Database Interaction                          */
+/************************************************************************/
+
+local void init_db(void)
+{
+    db->Query(NULL, NULL, 0, CREATE_RATINGS_TABLE);
+}
+
+/* A player's rating, loaded when they enter */
+local void db_rating(int status, db_res *res, void *clos)
+{
+    char *name = clos;
+    Player *p = pd->FindPlayer(name);
+    free(name);
+
+    if (!p || status != 0 || res == NULL)
+        return;
+
+    db_row *row = db->GetRow(res);
+    if (!row)
+        return;
+
+    //a game that ended since the query was sent has rated them already
+    Pdata *pdata = PPDATA(p, playerKey);
+    if (pdata->ratingloaded)
+        return;
+    pdata->rating = atoi(db->GetField(row, 0));
+    pdata->ratingloaded = 1;
+}
+
+local void LoadRating(Player *p)
+{
+    Pdata *pdata = PPDATA(p, playerKey);
+    pdata->rating = DEFAULT_RATING;
+    pdata->ratingloaded = 0;
+
+    if (!db)
+        return;
+
+    char *name = strdup(p->name);
+    if (name)
+        db->Query(db_rating, name, 1, SELECT_RATING, p->name);
+}
+
+/* Returned result from ?pbrating */
+local void db_top(int status, db_res *res, void *clos)
+{
+    char *name = clos;
+    Player *p = pd->FindPlayer(name);
+    free(name);
+
+    if (!p || status != 0 || res == NULL)
+        return;
+
+    if (db->GetRowCount(res) < 1)
+    {
+        chat->SendMessage(p, "Nobody has a paintball rating yet.");
+        return;
+    }
+
+    chat->SendMessage(p, "Top paintball ratings:");
+
+    db_row *row;
+    int rank = 0;
+    while ((row = db->GetRow(res)))
+    {
+        rank++;
+        chat->SendMessage(p, "%2i. %-24s %5s  (%s games)", rank,
+            db->GetField(row, 0), db->GetField(row, 1), db->GetField(row, 2));
+    }
+}
 
 /************************************************************************/
 /*                          Interface Functions                         */
@@ -132,10 +333,12 @@ local void Abort(Arena *arena, Player *host, int debug)
     /* Reset values */
     Adata *adata = P_ARENA_DATA(arena, arenaKey);
     adata->started = 0;
-    adata->blue = 0;
-    adata->green = 0;
+    memset(adata->score, 0, sizeof(adata->score));
     adata->goals = 0;
+    adata->minutes = 0;
+    adata->nteams = 2;
     adata->lockships = 0;
+    adata->winner = -1;
     
     chat->SendMessage(host, "Game aborted: Invalid syntax. Please type '?start' for more help.");
     //chat->SendMessage(host, "Debug: %i", debug);
@@ -152,29 +355,42 @@ local void Begin(Player *host, Arena *arena, const char *params)
     }
     else
         adata->started = 1;
+    adata->winner = -1;
     
     /* Get Game Options*/
-    //goals
-    int goals;
+    //goals and/or minutes; a game needs at least one way to end
+    int goals, minutes, nteams = 2;
     char *next, *string;
     string = getOption(params, 'g');
+    goals = atoi(string);
+    string = getOption(params, 't');
+    minutes = atoi(string);
     
-    if (string != next)
+    if ((!goals) && (!minutes))
     {
-        goals = atoi(string);
-        if ((goals <= 15) && (goals > 0))
-            adata->goals = goals;
-        else
-        {
-            Abort(arena, host, 1);
-            return;
-        }
+        Abort(arena, host, 2);
+        return;
     }
-    else
+    if ((goals < 0) || (goals > 15) || (minutes < 0) || (minutes > 60))
     {
-        Abort(arena, host, 2);
+        Abort(arena, host, 1);
         return;
     }
+    adata->goals = goals;
+    adata->minutes = minutes;
+
+    //teams
+    string = getOption(params, 'n');
+    if (strlen(string))
+        nteams = atoi(string);
+    if ((nteams < 2) || (nteams > MAX_TEAMS))
+    {
+        Abort(arena, host, 5);
+        return;
+    }
+    adata->nteams = nteams;
+    memset(adata->score, 0, sizeof(adata->score));
+    adata->overtime = 0;
     
     //ships
     string = getOption(params, 's');
@@ -246,17 +462,7 @@ local void Begin(Player *host, Arena *arena, const char *params)
     }
     
     /* Close the doors */
-    Player *d;
-    Link *link;
-
-    cs->ArenaOverride(arena, ok_Doors, 255);
-
-    pd->Lock();
-    FOR_EACH_PLAYER(d)
-    {
-        cs->SendClientSettings(d);
-    }
-    pd->Unlock();
+    SetDoors(arena, 255);
     
     chat->SendArenaSoundMessage(arena, 2, "Paintball will start in 10 seconds, get ready!");
     if (adata->lockships)
@@ -266,7 +472,7 @@ local void Begin(Player *host, Arena *arena, const char *params)
     
     adata->started = 1;
     /* Start the timer */
-    ml->SetTimer(TimeUp, 1000, 1000, host, NULL);
+    ml->SetTimer(TimeUp, 1000, 1000, arena, arena);
 }
 
 /* Set as legal ship  */
@@ -288,9 +494,9 @@ local void CheckLegalShip(Arena *arena)
     Player *g;
     Link *link;
     pd->Lock();
-    FOR_EACH_PLAYER(g)
+    FOR_EACH(&adata->players, g, link)
     {
-        if ((g->arena == arena) && g->p_ship != SHIP_SPEC)
+        if (g->p_ship != SHIP_SPEC)
         {
             int i, legal = 0;
             for (i = 0; i < 8; i++)
@@ -306,30 +512,41 @@ local void CheckLegalShip(Arena *arena)
 }
 
 /* After 10 seconds have passed */
-local int TimeUp(void *p)
+local int TimeUp(void *a)
 {
-    Player *host = p;
-    Arena *arena = host->arena;
-    
+    Arena *arena = a;
+
     Adata *adata = P_ARENA_DATA(arena, arenaKey);
     if (adata->started == 0)
         return 0;
 
-    /* Open the Doors and warp players */
-    Player *g;
-    Link *link;
+    /* Even out the teams, open the Doors and warp players */
+    if (cfg->GetInt(arena->cfg, "Paintball", "Balance", 1))
+        Balance(arena);
+    SetDoors(arena, 0);
+    WarpAll(arena);
 
-    cs->ArenaOverride(arena, ok_Doors, 0);
+    ResetRoster(arena);
 
+    Player *g;
+    Link *link;
     pd->Lock();
-    FOR_EACH_PLAYER(g)
+    FOR_EACH(&adata->players, g, link)
     {
-        cs->SendClientSettings(g);
+        Pdata *pdata = PPDATA(g, playerKey);
+
+        //only freqs 0 to N-1 are teams, whether or not Balance moved anyone
+        if ((g->p_ship != SHIP_SPEC) && (g->p_freq >= adata->nteams))
+            game->SetFreq(g, g->p_freq % adata->nteams);
+
+        pdata->score = 0;
+        pdata->kills = 0;
+        pdata->deaths = 0;
+        pdata->slot = 0;
 
-        Target target;
-        target.type = T_PLAYER;
-        target.u.p = g;
-        game->GivePrize(&target, 7, 1);
+        //everyone starting in a ship is on the roster, and so rated
+        if (g->p_ship != SHIP_SPEC)
+            Slot(g);
     }
     pd->Unlock();
 
@@ -337,14 +554,36 @@ local int TimeUp(void *p)
 
     CheckLegalShip(arena);
 
-    chat->SendArenaSoundMessage(arena, 104, "Paintball has started! First team to get %i %s wins!", goals, goals == 1 ? "goal" : "goals");
-    chat->SendArenaMessage(arena, "Team 0: EVENS (Blue Team), Team 1: ODDS (Green Team)");
+    if (goals && adata->minutes)
+        chat->SendArenaSoundMessage(arena, 104, "Paintball has started! First team to get %i %s, or the team ahead after %i %s, wins!",
+            goals, goals == 1 ? "goal" : "goals", adata->minutes, adata->minutes == 1 ? "minute" : "minutes");
+    else if (goals)
+        chat->SendArenaSoundMessage(arena, 104, "Paintball has started! First team to get %i %s wins!", goals, goals == 1 ? "goal" : "goals");
+    else
+        chat->SendArenaSoundMessage(arena, 104, "Paintball has started! The team ahead after %i %s wins!",
+            adata->minutes, adata->minutes == 1 ? "minute" : "minutes");
+
+    if (adata->nteams == 2)
+        chat->SendArenaMessage(arena, "Team 0: EVENS (Blue Team), Team 1: ODDS (Green Team)");
+    else
+    {
+        char teams[256];
+        int i, pos = 0;
+        for (i = 0; i < adata->nteams; i++)
+            pos += snprintf(teams + pos, sizeof(teams) - pos, "%sTeam %i: %s", i ? ", " : "", i, TeamName(i));
+        chat->SendArenaMessage(arena, "%s", teams);
+    }
 
     adata->started = 2;
+    if (adata->minutes)
+        ml->SetTimer(TimeLimit, adata->minutes * 6000, adata->minutes * 6000, arena, arena);
 
     mm->RegCallback(CB_PLAYERACTION, PlayerAction, arena);
     mm->RegCallback(CB_SHIPFREQCHANGE, ShipFreqChange, arena);
     mm->RegCallback(CB_GOAL, Check, arena);
+    mm->RegCallback(CB_KILL, Kill, arena);
+    mm->RegCallback(CB_BALLPICKUP, BallPickup, arena);
+    mm->RegCallback(CB_BALLFIRE, BallFire, arena);
     
     return 0;
 }
@@ -352,15 +591,16 @@ local int TimeUp(void *p)
 /* Check if players have left the arena or specced. */
 local void LCheck(Arena *arena, Player *pe)
 {
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
     Player *winner;
     
     Player *p; 
     Link *link;
     int i = 0;
     pd->Lock();
-    FOR_EACH_PLAYER(p)
+    FOR_EACH(&adata->players, p, link)
     {
-        if ((p->arena == arena) && (p->p_ship != SHIP_SPEC) && (p!=pe))
+        if ((p->p_ship != SHIP_SPEC) && (p!=pe))
         {
             winner = p;
             i++;
@@ -374,41 +614,516 @@ local void LCheck(Arena *arena, Player *pe)
     }
 }
 
-/* End the current game */
-local void Stop(Arena* arena)
+/* Set the arena's doors and send the new settings to those in it. The
+ * override is set once, and only pushed if the mode actually changed. */
+local void SetDoors(Arena *arena, int mode)
 {
-    /* Close the doors */
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+    if (adata->doors == mode)
+        return;
+
+    adata->doors = mode;
+    cs->ArenaOverride(arena, ok_Doors, mode);
+
     Player *p;
     Link *link;
+    pd->Lock();
+    FOR_EACH(&adata->players, p, link)
+        cs->SendClientSettings(p);
+    pd->Unlock();
+}
 
-    cs->ArenaOverride(arena, ok_Doors, 255);
+/* Warp everyone in the arena, with one prize to the whole arena */
+local void WarpAll(Arena *arena)
+{
+    Target target;
+    target.type = T_ARENA;
+    target.u.arena = arena;
+    game->GivePrize(&target, 7, 1);
+}
+
+/* Split the players in ships into teams of near equal rating. Each
+ * player, best first, joins the team furthest behind (while it has
+ * room), then single swaps between two teams are made while any of them
+ * brings the totals closer together. Freqs are only set once the split
+ * is final. */
+local void Balance(Arena *arena)
+{
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+    Player *players[MAX_BALANCE];
+    int rating[MAX_BALANCE], team[MAX_BALANCE];
+    int i, j, t, n = 0, nteams = adata->nteams;
 
+    Player *p;
+    Link *link;
     pd->Lock();
-    FOR_EACH_PLAYER(p)
+    FOR_EACH(&adata->players, p, link)
     {
-        /* Send new door settings */
-        cs->SendClientSettings(p);
-        /* Warp all players */
-        Target target;
-        target.type = T_PLAYER;
-        target.u.p = p;
-        game->GivePrize(&target, 7, 1);
+        if ((p->p_ship == SHIP_SPEC) || (n == MAX_BALANCE))
+            continue;
+
+        //insert by rating, best first
+        int r = ((Pdata*)PPDATA(p, playerKey))->rating;
+        for (i = n; (i > 0) && (rating[i - 1] < r); i--)
+        {
+            players[i] = players[i - 1];
+            rating[i] = rating[i - 1];
+        }
+        players[i] = p;
+        rating[i] = r;
+        n++;
     }
     pd->Unlock();
 
-    /* Reset arena data */
+    if (n < nteams)
+        return;
+
+    /* Greedy: best player first, into whichever team is furthest behind */
+    int sum[MAX_TEAMS] = { 0 }, size[MAX_TEAMS] = { 0 };
+    int room = (n + nteams - 1) / nteams;
+    for (i = 0; i < n; i++)
+    {
+        int low = -1;
+        for (t = 0; t < nteams; t++)
+            if ((size[t] < room) && ((low < 0) || (sum[t] < sum[low])))
+                low = t;
+        team[i] = low;
+        sum[low] += rating[i];
+        size[low]++;
+    }
+
+    /* Refine: take the swap that most lowers the spread of the totals
+     * (the sum of their squares) until none does. Moving d points from
+     * team a to team b changes it by 2d(Sb - Sa) + 2d^2. */
+    int passes;
+    for (passes = 0; passes < n; passes++)
+    {
+        int besti = -1, bestj = -1;
+        long best = 0;
+        for (i = 0; i < n; i++)
+        {
+            for (j = 0; j < n; j++)
+            {
+                if (team[i] == team[j])
+                    continue;
+                long d = rating[i] - rating[j];
+                long change = 2 * d * (sum[team[j]] - sum[team[i]]) + 2 * d * d;
+                if (change < best)
+                {
+                    best = change;
+                    besti = i;
+                    bestj = j;
+                }
+            }
+        }
+        if (besti < 0)
+            break;
+
+        int a = team[besti], b = team[bestj], d = rating[besti] - rating[bestj];
+        sum[a] -= d;
+        sum[b] += d;
+        team[besti] = b;
+        team[bestj] = a;
+    }
+
+    for (i = 0; i < n; i++)
+        if (players[i]->p_freq != team[i])
+            game->SetFreq(players[i], team[i]);
+
+    char teams[256];
+    int pos = 0;
+    for (t = 0; t < nteams; t++)
+        pos += snprintf(teams + pos, sizeof(teams) - pos, "%s%s %i", t ? ", " : "", TeamName(t), size[t] ? sum[t] / size[t] : 0);
+    chat->SendArenaMessage(arena, "Teams balanced by rating: %s.", teams);
+}
+
+/* Move everyone's rating by the result of the game just won, and write
+ * them all back in one statement. Each team is rated against every other
+ * one, and the changes averaged: a win against the winner, a loss to it,
+ * and a draw between two teams that both lost. */
+local void Rate(Arena *arena)
+{
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+    Roster *r = &adata->roster;
+    int sum[MAX_TEAMS] = { 0 }, size[MAX_TEAMS] = { 0 };
+    int k = cfg->GetInt(arena->cfg, "Paintball", "RatingK", 32);
+    int bonus = cfg->GetInt(arena->cfg, "Paintball", "GoalBonus", 2);
+    int nteams = adata->nteams, i, t, u;
+
+    /* Everyone who played counts for the team they played on last,
+     * including those who have since gone to spec or left */
+    for (i = 0; i < r->n; i++)
+    {
+        if ((r->freq[i] < 0) || (r->freq[i] >= nteams))
+            continue;
+        sum[r->freq[i]] += r->rating[i];
+        size[r->freq[i]]++;
+    }
+
+    if (!size[adata->winner])
+        return;
+
+    double change[MAX_TEAMS] = { 0 };
+    for (t = 0; t < nteams; t++)
+    {
+        int opponents = 0;
+        for (u = 0; (u < nteams) && size[t]; u++)
+        {
+            if ((u == t) || (!size[u]))
+                continue;
+
+            //expected result against them, from the average ratings
+            double mine = (double)sum[t] / size[t], theirs = (double)sum[u] / size[u];
+            double expected = 1.0 / (1.0 + pow(10.0, (theirs - mine) / 400.0));
+            double result = (t == adata->winner) ? 1.0 : (u == adata->winner) ? 0.0 : 0.5;
+
+            //bigger wins move ratings further, as in World Football Elo
+            int margin = abs(adata->score[t] - adata->score[u]);
+            double g = (margin <= 1) ? 1.0 : (margin == 2) ? 1.5 : (11.0 + margin) / 8.0;
+
+            change[t] += k * g * (result - expected);
+            opponents++;
+        }
+        if (opponents)
+            change[t] /= opponents;
+    }
+
+    /* Goal bonuses are paid for by the losing teams, shared evenly, so
+     * goals move rating between players without making any */
+    int pool = 0, losers = 0, paid = 0;
+    for (i = 0; i < r->n; i++)
+    {
+        if ((r->freq[i] < 0) || (r->freq[i] >= nteams))
+            continue;
+        pool += bonus * r->goals[i];
+        if (r->freq[i] != adata->winner)
+            losers++;
+    }
+
+    int len = 256 + r->n * (2 * 24 + 32);
+    char *query = db ? malloc(len) : NULL;
+    int pos = 0, rows = 0;
+    if (query)
+        pos = snprintf(query, len, "INSERT INTO `pbratings` (`name`, `rating`, `games`, `date`) VALUES");
+
+    for (i = 0; i < r->n; i++)
+    {
+        if ((r->freq[i] < 0) || (r->freq[i] >= nteams))
+            continue;
+
+        r->rating[i] += (int)floor(change[r->freq[i]] + 0.5);
+        if (losers)
+        {
+            r->rating[i] += bonus * r->goals[i];
+            if (r->freq[i] != adata->winner)
+                r->rating[i] -= pool / losers + (paid++ < pool % losers);
+        }
+
+        //those still online keep the new rating, whatever a late load says
+        Player *p = pd->FindPlayer(r->name[i]);
+        if (p)
+        {
+            Pdata *pdata = PPDATA(p, playerKey);
+            pdata->rating = r->rating[i];
+            pdata->ratingloaded = 1;
+        }
+
+        if (query)
+        {
+            pos += snprintf(query + pos, len - pos, "%s(", rows++ ? "," : "");
+            pos = AppendHex(query, pos, len, r->name[i]);
+            pos += snprintf(query + pos, len - pos, ",%d,1,NOW())", r->rating[i]);
+        }
+    }
+
+    if (query)
+    {
+        snprintf(query + pos, len - pos,
+            " ON DUPLICATE KEY UPDATE `rating`=VALUES(`rating`), `games`=`games`+1, `date`=NOW();");
+        if (rows)
+            db->Query(NULL, NULL, 0, query);
+        free(query);
+    }
+}
+
+/* Name of the team on a freq */
+local const char *TeamName(int freq)
+{
+    static const char *names[MAX_TEAMS] =
+        { "Blue", "Green", "Freq 2", "Freq 3", "Freq 4", "Freq 5", "Freq 6", "Freq 7" };
+    return ((freq >= 0) && (freq < MAX_TEAMS)) ? names[freq] : "Spectators";
+}
+
+/* Tell the arena the score */
+local void ShowScore(Arena *arena)
+{
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+    char line[256];
+    int t, pos = 0;
+
+    for (t = 0; t < adata->nteams; t++)
+        pos += snprintf(line + pos, sizeof(line) - pos, " %s: %i", TeamName(t), adata->score[t]);
+    chat->SendArenaMessage(arena, "SCORE:%s", line);
+}
+
+/* A team has won the game */
+local void Win(Arena *arena, int freq)
+{
     Adata *adata = P_ARENA_DATA(arena, arenaKey);
+
+    chat->SendArenaSoundMessage(arena, 5, "%s Team (freq %i) wins Paintball!", TeamName(freq), freq);
+    adata->winner = freq;
+    balls->EndGame(arena);
+    Stop(arena);
+}
+
+/* The time limit is up: the team ahead wins, or a tie goes to sudden death */
+local int TimeLimit(void *a)
+{
+    Arena *arena = a;
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+    if (adata->started != 2)
+        return 0;
+
+    int t, leader = 0, tied = 0;
+    for (t = 1; t < adata->nteams; t++)
+    {
+        if (adata->score[t] > adata->score[leader])
+        {
+            leader = t;
+            tied = 0;
+        }
+        else if (adata->score[t] == adata->score[leader])
+            tied = 1;
+    }
+
+    if (tied)
+    {
+        adata->overtime = 1;
+        chat->SendArenaSoundMessage(arena, 2, "Time's up, and it's a tie! Sudden death overtime: the first team to take the lead wins!");
+    }
+    else
+    {
+        chat->SendArenaMessage(arena, "Time's up!");
+        Win(arena, leader);
+    }
+    return 0;
+}
+
+/* A player's roster slot in the current game, found again by name if
+ * they left and came back. -1 if the roster is full. */
+local int Slot(Player *p)
+{
+    Adata *adata = P_ARENA_DATA(p->arena, arenaKey);
+    Pdata *pdata = PPDATA(p, playerKey);
+    Roster *r = &adata->roster;
+    int i;
+
+    if (pdata->slot)
+        i = pdata->slot - 1;
+    else
+    {
+        for (i = 0; i < r->n; i++)
+            if (!strcmp(r->name[i], p->name))
+                break;
+
+        if (i == r->n)
+        {
+            if (r->n == MAX_ROSTER)
+                return -1;
+            r->n++;
+            astrncpy(r->name[i], p->name, sizeof(r->name[i]));
+            r->goals[i] = r->assists[i] = r->kills[i] = r->deaths[i] = 0;
+            r->possession[i] = r->longestcarry[i] = 0;
+        }
+        pdata->slot = i + 1;
+    }
+
+    r->freq[i] = p->p_freq;
+    r->rating[i] = pdata->rating;
+    return i;
+}
+
+/* Start a new game's statistics */
+local void ResetRoster(Arena *arena)
+{
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+    int i, bid;
+
+    adata->roster.n = 0;
+    adata->matchstart = current_ticks();
+    for (bid = 0; bid < MAXBALLS; bid++)
+    {
+        adata->touch[bid][0] = adata->touch[bid][1] = -1;
+        adata->carrier[bid] = -1;
+        adata->control[bid] = -1;
+    }
+    for (i = 0; i < MAX_TEAMS; i++)
+        adata->teamposs[i] = adata->longestposs[i] = 0;
+}
+
+/* A ball has left its carrier: credit them the time they had it */
+local void Release(Arena *arena, int bid)
+{
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+    int slot = adata->carrier[bid];
+
+    if (slot < 0)
+        return;
+
+    int held = TICK_DIFF(current_ticks(), adata->carried[bid]);
+    adata->roster.possession[slot] += held;
+    if (held > adata->roster.longestcarry[slot])
+        adata->roster.longestcarry[slot] = held;
+    adata->carrier[bid] = -1;
+}
+
+/* A team has the ball. Passes within the team keep their spell going;
+ * the other team getting it ends it. */
+local void TakeControl(Arena *arena, int bid, int freq)
+{
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+
+    if (adata->control[bid] == freq)
+        return;
+
+    EndControl(arena, bid);
+    if ((freq < 0) || (freq >= adata->nteams))
+        return;
+    adata->control[bid] = freq;
+    adata->controlsince[bid] = current_ticks();
+}
+
+/* Close the spell of whoever controls a ball */
+local void EndControl(Arena *arena, int bid)
+{
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+    int freq = adata->control[bid];
+
+    if (freq < 0)
+        return;
+
+    int spell = TICK_DIFF(current_ticks(), adata->controlsince[bid]);
+    adata->teamposs[freq] += spell;
+    if (spell > adata->longestposs[freq])
+        adata->longestposs[freq] = spell;
+    adata->control[bid] = -1;
+}
+
+/* Ticks a team has had the ball, up to now */
+local int TeamPossession(Arena *arena, int freq)
+{
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+    int bid, total = adata->teamposs[freq];
+    ticks_t now = current_ticks();
+
+    for (bid = 0; bid < MAXBALLS; bid++)
+        if (adata->control[bid] == freq)
+            total += TICK_DIFF(now, adata->controlsince[bid]);
+    return total;
+}
+
+/* A team's longest spell with the ball, counting the one it may be in now */
+local int LongestPossession(Arena *arena, int freq)
+{
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+    int bid, longest = adata->longestposs[freq];
+    ticks_t now = current_ticks();
+
+    for (bid = 0; bid < MAXBALLS; bid++)
+        if ((adata->control[bid] == freq) && (TICK_DIFF(now, adata->controlsince[bid]) > longest))
+            longest = TICK_DIFF(now, adata->controlsince[bid]);
+    return longest;
+}
+
+/* Print the game's statistics and add them to the match log */
+local void Summary(Arena *arena)
+{
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+    Roster *r = &adata->roster;
+    int i, bid;
+
+    for (bid = 0; bid < MAXBALLS; bid++)
+    {
+        Release(arena, bid);
+        EndControl(arena, bid);
+    }
+    if (!r->n)
+        return;
+
+    int t, total = 0;
+    char line[256];
+    for (t = 0; t < adata->nteams; t++)
+        total += adata->teamposs[t];
+
+    chat->SendArenaMessage(arena, "%-24s %4s %5s %7s %5s %6s %5s",
+        "Player", "Team", "Goals", "Assists", "Kills", "Deaths", "Ball");
+    for (i = 0; i < r->n; i++)
+        chat->SendArenaMessage(arena, "%-24s %4i %5i %7i %5i %6i %4is",
+            r->name[i], r->freq[i], r->goals[i], r->assists[i], r->kills[i], r->deaths[i], r->possession[i] / 100);
+    int pos = 0;
+    for (t = 0; t < adata->nteams; t++)
+        pos += snprintf(line + pos, sizeof(line) - pos, "%s %s %i%% (longest %is)", t ? "," : "", TeamName(t),
+            total ? adata->teamposs[t] * 100 / total : 100 / adata->nteams, adata->longestposs[t] / 100);
+    chat->SendArenaMessage(arena, "Possession:%s", line);
+
+    const char *file = cfg->GetStr(arena->cfg, "Paintball", "MatchLog");
+    if (!file)
+        file = "paintball-matches.log";
+    if (!*file)
+        return;
+
+    FILE *f = fopen(file, "a");
+    if (!f)
+        return;
+
+    char date[32];
+    time_t now = time(NULL);
+    strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&now));
+    fprintf(f, "%s\t%s\twinner %i\t%i seconds%s", date, arena->name,
+        adata->winner, TICK_DIFF(current_ticks(), adata->matchstart) / 100, adata->overtime ? " (overtime)" : "");
+    for (t = 0; t < adata->nteams; t++)
+        fprintf(f, "\tfreq %i: %i goals, %i seconds possession", t, adata->score[t], adata->teamposs[t] / 100);
+    fprintf(f, "\n");
+    for (i = 0; i < r->n; i++)
+        fprintf(f, "\t%s\t%i\t%i\t%i\t%i\t%i\t%i\t%i\n", r->name[i], r->freq[i], r->goals[i], r->assists[i],
+            r->kills[i], r->deaths[i], r->possession[i] / 100, r->longestcarry[i] / 100);
+    fclose(f);
+}
+
+/* End the current game */
+local void Stop(Arena* arena)
+{
+    /* Settle ratings if the game was won */
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+    if ((adata->started == 2) && (adata->winner >= 0))
+        Rate(arena);
+    if (adata->started == 2)
+        Summary(arena);
+
+    /* Close the doors and warp all players */
+    SetDoors(arena, 255);
+    WarpAll(arena);
+
+    /* Reset arena data */
     adata->started = 0;
-    adata->blue = 0;
-    adata->green = 0;
+    memset(adata->score, 0, sizeof(adata->score));
     adata->goals = 0;
+    adata->minutes = 0;
+    adata->overtime = 0;
+    adata->nteams = 2;
     adata->lockships = 0;
+    adata->winner = -1;
 
     /* Clear timers and unregister callbacks */
     ml->ClearTimer(TimeUp, arena);
+    ml->ClearTimer(TimeLimit, arena);
     mm->UnregCallback(CB_PLAYERACTION, PlayerAction, arena);
     mm->UnregCallback(CB_SHIPFREQCHANGE, ShipFreqChange, arena);
     mm->UnregCallback(CB_GOAL, Check, arena);
+    mm->UnregCallback(CB_KILL, Kill, arena);
+    mm->UnregCallback(CB_BALLPICKUP, BallPickup, arena);
+    mm->UnregCallback(CB_BALLFIRE, BallFire, arena);
 }
 
 /************************************************************************/
@@ -425,6 +1140,15 @@ local void ShipFreqChange(Player *p, int newship, int oldship, int newfreq, int
     else
     {
         Adata *adata = P_ARENA_DATA(p->arena, arenaKey);
+
+        /* Only freqs 0 to N-1 are teams in this game */
+        if ((adata->started == 2) && (p->p_freq >= adata->nteams))
+            game->SetFreq(p, p->p_freq % adata->nteams);
+
+        //joining, or switching teams, puts them on the roster for that team
+        if (adata->started == 2)
+            Slot(p);
+
         if (!adata->lockships)
             return;
         
@@ -459,7 +1183,10 @@ local void PlayerAction(Player *p, int action, Arena *arena)
     {
         Adata *adata = P_ARENA_DATA(arena, arenaKey);
         int wingoals = adata->goals;
-        chat->SendSoundMessage(p, 26, "We are playing Paintball to %i %s by a team.", wingoals, wingoals == 1 ? "goal" : "goals");
+        if (wingoals)
+            chat->SendSoundMessage(p, 26, "We are playing Paintball to %i %s by a team.", wingoals, wingoals == 1 ? "goal" : "goals");
+        else
+            chat->SendSoundMessage(p, 26, "We are playing %i minutes of Paintball.", adata->minutes);
     }
 }
 
@@ -469,32 +1196,109 @@ local void Check(Arena *arena, Player *p, int bid, int x, int y)
     /* Use our own soccer settings */
     Adata *adata = P_ARENA_DATA(p->arena, arenaKey);
     int wingoals = adata->goals;
+    int freq = p->p_freq, t;
+
+    //only the teams playing can score
+    if ((freq < 0) || (freq >= adata->nteams))
+        return;
+
+    ((Pdata*)PPDATA(p, playerKey))->score++;
 
-    if (p->p_freq == 0)
+    /* Credit the scorer, and the last teammate to touch the ball before them */
+    int slot = Slot(p);
+    if ((slot >= 0) && (bid >= 0) && (bid < MAXBALLS))
     {
-        adata->blue++;
-        chat->SendArenaSoundMessage(p->arena, 2, "Blue Team has scored!");
-        chat->SendArenaMessage(p->arena, "SCORE: Blue: %i Green: %i", adata->blue, adata->green);
+        Roster *r = &adata->roster;
+        int assist = (adata->touch[bid][0] == slot) ? adata->touch[bid][1] : adata->touch[bid][0];
+
+        Release(arena, bid);
+        EndControl(arena, bid);
+        r->goals[slot]++;
+        if ((assist >= 0) && (assist != slot) && (r->freq[assist] == p->p_freq))
+            r->assists[assist]++;
+        adata->touch[bid][0] = adata->touch[bid][1] = -1;
     }
-    else if (p->p_freq == 1)
+
+    adata->score[freq]++;
+    chat->SendArenaSoundMessage(p->arena, 2, "%s Team has scored!", TeamName(freq));
+    ShowScore(p->arena);
+
+    /* In overtime a goal only wins if it puts the team ahead of all the
+     * others: a team that was behind when time ran out must catch up first */
+    if (adata->overtime)
     {
-        adata->green++;
-        chat->SendArenaSoundMessage(p->arena, 2, "Green Team has scored!");
-        chat->SendArenaMessage(p->arena, "SCORE: Blue: %i Green: %i", adata->blue, adata->green);
+        for (t = 0; t < adata->nteams; t++)
+            if ((t != freq) && (adata->score[t] >= adata->score[freq]))
+                return;
+        Win(p->arena, freq);
     }
+    else if (wingoals && adata->score[freq] == wingoals)
+        Win(p->arena, freq);
+}
+
+/* Count kills and deaths */
+local void Kill(Arena *arena, Player *k, Player *p, int bounty, int flags, int pts, int green)
+{
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+    int ks = Slot(k), ps = Slot(p);
+
+    ((Pdata*)PPDATA(k, playerKey))->kills++;
+    ((Pdata*)PPDATA(p, playerKey))->deaths++;
+    if (ks >= 0)
+        adata->roster.kills[ks]++;
+    if (ps >= 0)
+        adata->roster.deaths[ps]++;
+}
+
+/* Someone has the ball: it counts as their touch, and their time with it starts */
+local void BallPickup(Arena *arena, Player *p, int bid)
+{
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+    int slot = Slot(p);
 
-    if (adata->blue == wingoals)
+    if ((slot < 0) || (bid < 0) || (bid >= MAXBALLS))
+        return;
+
+    Release(arena, bid);
+    if (adata->touch[bid][0] != slot)
     {
-        chat->SendArenaSoundMessage(p->arena, 5, "Blue Team (freq 0) wins Paintball!");
-        balls->EndGame(arena);
-        Stop(p->arena);
+        adata->touch[bid][1] = adata->touch[bid][0];
+        adata->touch[bid][0] = slot;
     }
-    else if (adata->green == wingoals)
+    adata->carrier[bid] = slot;
+    adata->carried[bid] = current_ticks();
+    TakeControl(arena, bid, p->p_freq);
+}
+
+/* The ball has been shot or dropped */
+local void BallFire(Arena *arena, Player *p, int bid)
+{
+    if ((bid >= 0) && (bid < MAXBALLS))
+        Release(arena, bid);
+}
+
+/* Keep the arena's player list, whether or not a game is on */
+local void Membership(Player *p, int action, Arena *arena)
+{
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+
+    pd->Lock();
+    if ((action == PA_ENTERARENA) && (p->arena == arena))
     {
-        chat->SendArenaSoundMessage(p->arena, 5, "Green Team (freq 1) wins Paintball!");
-        balls->EndGame(arena);
-        Stop(p->arena);
+        LLRemove(&adata->players, p);
+        LLAdd(&adata->players, p);
+        LoadRating(p);
+
+        //whatever they did in an earlier game is not this game's
+        Pdata *pdata = PPDATA(p, playerKey);
+        pdata->score = 0;
+        pdata->kills = 0;
+        pdata->deaths = 0;
+        pdata->slot = 0;
     }
+    else if ((action == PA_LEAVEARENA) || (action == PA_DISCONNECT))
+        LLRemove(&adata->players, p);
+    pd->Unlock();
 }
 
 /************************************************************************/
@@ -539,8 +1343,11 @@ local void cHost(const char *command, const char *params, Player *p, const Targe
         chat->SendMessage(p, "| Paintball | Two teams face off in a game of paintball (soccer). |");
         chat->SendMessage(p, "-------------------------------------------------------------------");
         chat->SendMessage(p, "Parameters: goals: -g(#)");
+        chat->SendMessage(p, "   time, in mins: -t(#)");
+        chat->SendMessage(p, "            teams: -n(#)");
         chat->SendMessage(p, "            ships: -s(#)");
         chat->SendMessage(p, "Example: ?start paintball -g(5) -s(1,2,3)");
+        chat->SendMessage(p, "         ?start paintball -g(10) -t(15) -n(4)");
     }
     else
     {
@@ -581,6 +1388,77 @@ local void cRules(const char *command, const char *params, Player *p, const Targ
     chat->SendMessage(p, "Two teams face off in a game of paintball (aka soccer, powerball, deathball).");
 }
 
+/* ?pbrating help information */
+local helptext_t pbrating_help =
+"Targets: none or player\n"
+"Args: none\n"
+"Shows your paintball rating, or that of the player you send it to,\n"
+"and the ten best rated players.\n";
+
+/* ?pbrating */
+local void cPbRating(const char *command, const char *params, Player *p, const Target *target)
+{
+    Player *t = (target->type == T_PLAYER) ? target->u.p : p;
+    Pdata *pdata = PPDATA(t, playerKey);
+
+    if (pdata->ratingloaded)
+        chat->SendMessage(p, "%s's paintball rating: %i", t->name, pdata->rating);
+    else
+        chat->SendMessage(p, "%s is unrated, and starts at %i.", t->name, DEFAULT_RATING);
+
+    if (!db)
+        return;
+
+    char *name = strdup(p->name);
+    if (name)
+        db->Query(db_top, name, 1, SELECT_TOP_RATINGS);
+}
+
+/* ?possession help information */
+local helptext_t possession_help =
+"Targets: none\n"
+"Args: none\n"
+"Shows each team's share of the ball and longest spell with it so far,\n"
+"and how long you have carried it.\n";
+
+/* ?possession */
+local void cPossession(const char *command, const char *params, Player *p, const Target *target)
+{
+    Adata *adata = P_ARENA_DATA(p->arena, arenaKey);
+    if (adata->started != 2)
+    {
+        chat->SendMessage(p, "There does not appear to be a game going on here.");
+        return;
+    }
+
+    int t, total = 0, pos = 0, poss[MAX_TEAMS];
+    char line[256];
+    for (t = 0; t < adata->nteams; t++)
+        total += poss[t] = TeamPossession(p->arena, t);
+    for (t = 0; t < adata->nteams; t++)
+        pos += snprintf(line + pos, sizeof(line) - pos, "%s %s %i%% (longest %is)", t ? "," : "", TeamName(t),
+            total ? poss[t] * 100 / total : 100 / adata->nteams, LongestPossession(p->arena, t) / 100);
+    chat->SendMessage(p, "Possession:%s", line);
+
+    Pdata *pdata = PPDATA(p, playerKey);
+    if (pdata->slot)
+    {
+        int slot = pdata->slot - 1, held = adata->roster.possession[slot];
+        int bid, longest = adata->roster.longestcarry[slot];
+        for (bid = 0; bid < MAXBALLS; bid++)
+        {
+            if (adata->carrier[bid] == slot)
+            {
+                int now = TICK_DIFF(current_ticks(), adata->carried[bid]);
+                held += now;
+                if (now > longest)
+                    longest = now;
+            }
+        }
+        chat->SendMessage(p, "You have carried the ball for %i seconds (longest %is).", held / 100, longest / 100);
+    }
+}
+
 /************************************************************************/
 /*                            Module Init                               */
 /************************************************************************/
@@ -611,9 +1489,11 @@ EXPORT int MM_paintball(int action, Imodman *mm_, Arena *arena)
         game = mm->GetInterface(I_GAME, arena);
         ml = mm->GetInterface(I_MAINLOOP, arena);
         pd = mm->GetInterface(I_PLAYERDATA, arena);
+        db = mm->GetInterface(I_RELDB, arena); //optional: without it everyone is rated the same
 
         if (!aman || !balls || !cfg || !chat || !cmd || !cs || !game || !ml || !pd)
         {
+            mm->ReleaseInterface(db);
             mm->ReleaseInterface(pd);
             mm->ReleaseInterface(ml);
             mm->ReleaseInterface(game);
@@ -633,6 +1513,7 @@ EXPORT int MM_paintball(int action, Imodman *mm_, Arena *arena)
 
             if ((!playerKey)  || (!arenaKey))
             {
+                mm->ReleaseInterface(db);
                 mm->ReleaseInterface(pd);
                 mm->ReleaseInterface(ml);
                 mm->ReleaseInterface(game);
@@ -649,11 +1530,34 @@ EXPORT int MM_paintball(int action, Imodman *mm_, Arena *arena)
             {
                 ok_Doors = cs->GetOverrideKey("Door", "Doormode");
 
+                /* Start the player list with anyone already here */
+                Adata *adata = P_ARENA_DATA(arena, arenaKey);
+                Player *p;
+                Link *link;
+                LLInit(&adata->players);
+                adata->doors = -1;
+                adata->nteams = 2;
+                if (db)
+                    init_db();
+                pd->Lock();
+                FOR_EACH_PLAYER(p)
+                {
+                    if (p->arena == arena)
+                    {
+                        LLAdd(&adata->players, p);
+                        LoadRating(p);
+                    }
+                }
+                pd->Unlock();
+                mm->RegCallback(CB_PLAYERACTION, Membership, arena);
+
                 cmd->AddCommand("host", cHost, arena, host_help);
                 cmd->AddCommand("start", cHost, arena, host_help);
                 cmd->AddCommand("stopevent", cStopEvent, arena, stop_help);
                 cmd->AddCommand("stop", cStopEvent, arena, stop_help);
                 cmd->AddCommand("rules", cRules, arena, rules_help);
+                cmd->AddCommand("pbrating", cPbRating, arena, pbrating_help);
+                cmd->AddCommand("possession", cPossession, arena, possession_help);
 
 
                 return MM_OK;
@@ -662,15 +1566,24 @@ EXPORT int MM_paintball(int action, Imodman *mm_, Arena *arena)
     }
     else if (action == MM_DETACH)
     {
+        Adata *adata = P_ARENA_DATA(arena, arenaKey);
+        mm->UnregCallback(CB_PLAYERACTION, Membership, arena);
+        ml->ClearTimer(TimeUp, arena);
+        ml->ClearTimer(TimeLimit, arena);
+        LLEmpty(&adata->players);
+
         pd->FreePlayerData(playerKey);
         aman->FreeArenaData(arenaKey);
 
+        cmd->RemoveCommand("possession", cPossession, arena);
+        cmd->RemoveCommand("pbrating", cPbRating, arena);
         cmd->RemoveCommand("rules", cRules, arena);
         cmd->RemoveCommand("stop", cStopEvent, arena);
         cmd->RemoveCommand("stopevent", cStopEvent, arena);
         cmd->RemoveCommand("start", cHost, arena);
         cmd->RemoveCommand("host", cHost, arena);
 
+        mm->ReleaseInterface(db);
         mm->ReleaseInterface(pd);
         mm->ReleaseInterface(ml);
         mm->ReleaseInterface(game);
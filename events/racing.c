@@ -8,6 +8,8 @@
  *   The map needs to have a defined region named "finish".
  *   The map can also have regions named "rocket", which will grant
  *     a rocket to any player that passes through it.
+ *   Split times are taken at regions named "checkpoint1",
+ *     "checkpoint2", etc., which must be passed in order.
  *   The arena's default spawn point must be in a closed off area,
  *     with the start line being created with doors.
  *
@@ -15,6 +17,69 @@
  * (some options are available). After an amount of time,
  * doors will be opened. Typing ?stop will cancel the event.
  *
+ * Busy arenas can split the entrants into heats (-h). Heats run one
+ * after another, or side by side from separate start gates (-p), each
+ * on its own frequency. The fastest racers from each heat (-a) then
+ * race each other in a final.
+ *
+ * Every track also feeds the racing ladder: a racer's best time on a
+ * track is worth 1000 * record / best points, and their ladder score
+ * is the sum over all tracks they've raced. The ladder is updated as
+ * results are stored rather than recomputed from racestats.
+ *
+ * Racers are also watched for speed hacks: if their position stream
+ * covers ground faster than their ship (or a rocket) can go, staff are
+ * told on mod chat and the racer's results are held in racestats_held
+ * until someone ?raceapprove-s or ?racereject-s them.
+ *
+ * Every racer's position stream is sampled during the race. When
+ * someone sets a track record, their run is saved as a "ghost"
+ * file, and later races replay it with a fake player to chase.
+ *
+ * Arena settings:
+ *
+ * [ Race ]
+ *  LongName = Devastation Speedway
+ *  ; name announced when a race starts (default: arena name)
+ *  Ghost = 1
+ *  ; 1 = replay the track record during races (default 1)
+ *  GhostDir = ghosts
+ *  ; directory ghost files are kept in (default ghosts)
+ *  GhostInterval = 100
+ *  ; milliseconds between recorded samples (default 100)
+ *  GhostFreq = 8000
+ *  ; frequency the ghost races on (default 8000)
+ *  MaxCorrection = 1000
+ *  ; most milliseconds lag compensation may take off a time (default 1000)
+ *  Standings = 0
+ *  ; racers shown in the on-screen standings, up to 10 (default 0: off).
+ *  ; The standings need the objects module, and are off without it.
+ *  StandingsObject = 1000
+ *  ; first LVZ object id of the standings. Slot s (from 0) uses
+ *  ; StandingsObject + 100*s + ship for its ship icon, + 10 + n for
+ *  ; n checkpoints taken, and + 9 once that racer has finished.
+ *  SpeedMargin = 20
+ *  ; percent over the fastest legal speed before a racer is flagged (default 20)
+ *  RecordWaitTimeout = 500
+ *  ; ticks a race waits for the track record to load before starting anyway (default 500)
+ *  HeatDelay = 1000
+ *  ; ticks between one round of heats and the next (default 1000)
+ *  HeatFreq = 0
+ *  ; frequency of the first gate; each gate races one higher (default 0)
+ *  Gates = 1
+ *  ; number of start gates heats can run from side by side (default 1)
+ *  Gate1X = 512
+ *  Gate1Y = 512
+ *  ; tile a heat leaving from gate 1 is warped to (default: no warp)
+ *
+ * Global settings:
+ *
+ * [ Race ]
+ *  ExportFile = race-results.jsonl
+ *  ; file every finished race is appended to, one JSON object per line
+ *  ExportMaxSize = 10485760
+ *  ; bytes the export may grow to before it is moved to <file>.1
+ *
  * Based on a plugin originally designed by XDOOM for
  * Deva-bot, recreated by Zachary Read for the ASSS server.
  *
@@ -22,34 +87,193 @@
 
 #include "asss.h"
 #include "clientset.h"
+#include "fake.h"
 #include "reldb.h"
+#include "objects.h"
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <time.h>
+#include <math.h>
+
+#include "sqlhex.h"
+
+#define RACE_MAX_SPLITS 16
+#define RACE_MAX_RACERS 256
+#define RACE_MAX_HEATS 16
+#define RACE_WINDOW 8
+#define RACE_MAX_STANDINGS 10
+
+/* Region bitmaps: one bit per tile of the 1024x1024 map, 32 words a row */
+#define BITMAP_WORDS (1024 * 1024 / 32)
+#define IN_BITMAP(bits, x, y) \
+    ((unsigned)(x) < 1024 && (unsigned)(y) < 1024 && \
+     ((bits)[((y) << 5) | ((x) >> 5)] >> ((x) & 31) & 1))
+
+#define HEAT_WAITING 0
+#define HEAT_RUNNING 1
+#define HEAT_DONE    2
+
+/* Ghost file layout: a header followed by count samples, each one the
+ * movement since the previous sample. Files are written in host byte
+ * order and are only meant to be read back by the same server. */
+#define GHOST_MAGIC "RGH1"
+
+typedef struct GhostHeader
+{
+    char magic[4];
+    u32 count;      //number of samples following the header
+    i32 time;       //race time of the run, in milliseconds
+    i32 ship;
+    i32 x, y;       //position of the first sample, in pixels
+    char name[24];
+} GhostHeader;
+
+typedef struct GhostSample
+{
+    i16 dx, dy;     //pixels moved since the previous sample
+    u16 dt;         //milliseconds since the previous sample
+    u8 rotation;
+    u8 status;
+} GhostSample;
+
+/* A finished run waiting to be written to the database */
+typedef struct RaceResult
+{
+    char name[24];
+    int ship;
+    int time;
+    int nsplits;
+    int splits[RACE_MAX_SPLITS];
+} RaceResult;
+
+/* A held result being approved or rejected. The row is read, deleted and
+ * the deletion counted by three queries sent back to back, so only the
+ * request whose DELETE removed it goes on to act on it. */
+typedef struct HeldQuery
+{
+    int id;
+    char staff[24];     //who asked
+    char arena[24];     //arena name, whose basename the result was held under
+    int found;          //1 = the SELECT returned the row below
+    char name[24];
+    int time;
+    int ship;
+} HeldQuery;
+
+/* The arena a track record query was sent for */
+typedef struct RecordQuery
+{
+    Arena *arena;
+    char name[24];
+} RecordQuery;
+
+/* A recent position, for the speed check */
+typedef struct WindowPos
+{
+    int x, y;
+    u32 time;
+} WindowPos;
 
 /* Player data */
 typedef struct Pdata
 {
     int won;
+    int racing;           //1 = on a heat's racer roster
+    int heat;             //index of that heat
+    int slot;             //index in that heat's roster
+    int benched;          //1 = put in spec until their heat starts
+    int benchship;        //ship to return them to
+    int finishtime;       //corrected finish time, in milliseconds
+    int place;            //order they finished in, across all heats
+    int finishedrace;     //race they last finished, 0 = none
+    int ladderpage;       //page of ?raceladder being looked up
+    WindowPos window[RACE_WINDOW]; //latest positions, oldest at windowpos
+    int windowpos;
+    int windowlen;
+    int speedcap;         //fastest legal speed, in pixels per 10 seconds
+    int flagged;          //1 = results are held for staff review
+    char evidence[128];
     int bestime; //in seconds
+    GhostSample *samples; //position stream recorded during the race
+    int nsamples;
+    int maxsamples;
+    int recording;        //0 = no first position yet, 1 = sampling
+    int startx, starty;   //first recorded position
+    int lastx, lasty;     //position of the last sample
+    u32 lasttime;         //client time of the last sample
+    u32 ppktime;          //client time of the latest position packet
+    ticks_t ppkrecv;      //server time that packet was handled
+    int pending;          //region waiting for its packet: 0 = none, -1 = finish, n = checkpoint n
+    int pendingraw;       //server-side race time when that region was entered
+    ticks_t pendingtick;  //server time it was entered
+    u32 pendingctime;     //client time of the last packet before then
+    ticks_t pendingrecv;  //server time that packet was handled, 0 = none
+    int nsplits;
+    int splits[RACE_MAX_SPLITS]; //corrected split times, in milliseconds
 } Pdata;
 
 local int playerKey;
 
+/* One group of racers that starts together. A race without heats is a
+ * single heat holding everyone. */
+typedef struct Heat
+{
+    int state;          //HEAT_WAITING, HEAT_RUNNING or HEAT_DONE
+    int final;          //1 = the final, filled from the other heats
+    int gate;           //start gate the heat leaves from
+    int starttime;
+    int finished;       //racers who crossed the finish line
+    int remaining;      //racers who have not finished yet
+    int nracers;
+    Player *racers[RACE_MAX_RACERS]; //everyone in the heat, finished or not
+} Heat;
+
 /* Arena data */
 typedef struct Adata
 {
     int started;
+    int race;            //number of the race being run, unique across arenas
     int lockships;
     int defaultship;
     int mystery;
     int starttime;
+    int heatsize;        //0 = everyone races at once
+    int advance;         //racers from each heat who make the final
+    int parallel;        //1 = run heats side by side from separate gates
+    Heat *heats;         //the final, if any, is the last one
+    int nheats;
+    int entrants;        //racers on any heat's roster
+    int recordready;     //1 = bestime and friends hold the stored record
+    ticks_t recordwait;  //when the race started waiting for it
+    u32 *rocketbits;     //tiles of the "rocket" region, NULL = no such region
+    int placed;          //racers who have finished, across all heats
+    int nstandings;      //slots in the standings overlay, 0 = off
+    int standingsdirty;  //1 = redraw at the next StandingsTick
+    int shownship[RACE_MAX_STANDINGS];     //ship shown in each slot, -1 = none
+    int shownprogress[RACE_MAX_STANDINGS]; //object offset shown for progress, -1 = none
     int bestime; //in seconds
-    //const char * bestname;
+    char bestname[24];
     int bestship;
     //const char * bestdate;
-    int finished;
+    int newrecord;       //1 = the record fell since results were last stored
+    RaceResult *results; //finishers not yet written to racestats
+    int nresults;
+    int maxresults;
+    int ghostinterval;   //milliseconds between recorded samples
+    Player *ghost;       //fake player replaying the track record
+    void *ghostmap;      //memory-mapped ghost file
+    size_t ghostlen;
+    int ghoststart;      //when the ghost left the start line
+    int ghostnext;       //index of the next sample to replay
+    int ghostx, ghosty;  //replayed position
+    int ghosttime;       //race time of the replayed position
 } Adata;
 
 local int arenaKey;
@@ -62,25 +286,169 @@ local Iconfig *cfg;
 local Ichat *chat;
 local Icmdman *cmd;
 local Iclientset *cs;
+local Ifake *fake;
 local Igame *game;
+local Ilagquery *lagq;
+local Ilogman *lm;
 local Imainloop *ml;
 local Imapdata *mapdata;
+local Iobjects *obj;
 local Iplayerdata *pd;
 local Ireldb *db;
 
 #define CREATE_RACESTATS_TABLE \
 " CREATE TABLE IF NOT EXISTS `racestats` (" \
+"  `id` int(11) NOT NULL auto_increment," \
+"  `time` int(11) NOT NULL default '0'," \
+"  `name` varchar(24) NOT NULL default ''," \
+"  `ship` int(10) NOT NULL default '0'," \
+"  `arena` char(24) NOT NULL default ''," \
+"  `date` timestamp NOT NULL," \
+"  PRIMARY KEY  (`id`)," \
+"  KEY `arena_time` (`arena`,`time`)," \
+"  KEY `arena_name_time` (`arena`,`name`,`time`)" \
+");"
+
+/* Older tables used `time` as the primary key, which silently dropped
+ * any result that tied an existing time to the millisecond. */
+#define MIGRATE_RACESTATS_TABLE \
+" ALTER TABLE `racestats`" \
+"  DROP PRIMARY KEY," \
+"  ADD `id` int(11) NOT NULL auto_increment FIRST," \
+"  ADD PRIMARY KEY (`id`)," \
+"  ADD KEY `arena_time` (`arena`,`time`)," \
+"  ADD KEY `arena_name_time` (`arena`,`name`,`time`);"
+
+/* Result columns are always selected in this order */
+#define RACESTATS_COLUMNS "`time`, `name`, `ship`, `date`"
+
+#define SELECT_TRACK_BEST \
+"SELECT " RACESTATS_COLUMNS " FROM `racestats` WHERE arena=? ORDER BY `time` ASC LIMIT 1;"
+
+#define SELECT_PERSONAL_BEST \
+"SELECT " RACESTATS_COLUMNS " FROM `racestats` WHERE arena=? AND name=? ORDER BY `time` ASC LIMIT 1;"
+
+/* The racing ladder. raceladder_tracks holds each racer's best time on
+ * each track and the points it is currently worth; raceladder holds the
+ * sum of those points. */
+#define CREATE_LADDER_TRACKS_TABLE \
+" CREATE TABLE IF NOT EXISTS `raceladder_tracks` (" \
+"  `name` varchar(24) NOT NULL default ''," \
+"  `arena` char(24) NOT NULL default ''," \
+"  `time` int(11) NOT NULL default '0'," \
+"  `score` int(11) NOT NULL default '0'," \
+"  PRIMARY KEY  (`arena`,`name`)," \
+"  KEY `name` (`name`)" \
+");"
+
+#define CREATE_LADDER_TABLE \
+" CREATE TABLE IF NOT EXISTS `raceladder` (" \
+"  `name` varchar(24) NOT NULL default ''," \
+"  `score` int(11) NOT NULL default '0'," \
+"  `tracks` int(11) NOT NULL default '0'," \
+"  PRIMARY KEY  (`name`)," \
+"  KEY `score` (`score`)" \
+");"
+
+/* Build the ladder from existing results; only ever run on an empty ladder */
+#define SEED_LADDER_TRACKS \
+"INSERT INTO `raceladder_tracks` (`name`, `arena`, `time`, `score`)" \
+" SELECT s.name, s.arena, MIN(s.time), ROUND(1000 * r.record / MIN(s.time))" \
+" FROM `racestats` s JOIN (SELECT arena, MIN(time) AS record FROM `racestats` WHERE time > 0 GROUP BY arena) r" \
+" ON r.arena = s.arena WHERE s.time > 0 GROUP BY s.arena, s.name, r.record;"
+
+#define SEED_LADDER \
+"INSERT INTO `raceladder` (`name`, `score`, `tracks`)" \
+" SELECT name, SUM(score), COUNT(*) FROM `raceladder_tracks` GROUP BY name;"
+
+/* The track record, as stored: scores are worked out against this, so
+ * they never depend on whether the cached record has loaded yet */
+#define LADDER_RECORD \
+"SET @racerecord = (SELECT MIN(`time`) FROM `racestats` WHERE `arena`=? AND `time` > 0);"
+
+/* A new track record: rescore everyone on the track against it */
+#define LADDER_RESCALE \
+"UPDATE `raceladder` l JOIN `raceladder_tracks` t ON t.name = l.name" \
+" SET l.score = l.score - t.score + ROUND(1000 * @racerecord / t.time) WHERE t.arena=?;"
+
+#define LADDER_RESCALE_TRACKS \
+"UPDATE `raceladder_tracks` SET score = ROUND(1000 * @racerecord / time) WHERE arena=?;"
+
+/* A racer's result: credit the difference if it beats their best here */
+#define LADDER_ENSURE \
+"INSERT INTO `raceladder` (`name`, `score`, `tracks`) VALUES (?, 0, 0)" \
+" ON DUPLICATE KEY UPDATE name = name;"
+
+#define LADDER_CREDIT \
+"UPDATE `raceladder` l LEFT JOIN `raceladder_tracks` t ON t.name = l.name AND t.arena=?" \
+" SET l.score = l.score - IFNULL(t.score, 0) + ROUND(1000 * @racerecord / #), l.tracks = l.tracks + (t.name IS NULL)" \
+" WHERE l.name=? AND (t.name IS NULL OR t.time > #);"
+
+#define LADDER_TRACK_BEST \
+"INSERT INTO `raceladder_tracks` (`name`, `arena`, `time`, `score`) VALUES (?, ?, #, ROUND(1000 * @racerecord / #))" \
+" ON DUPLICATE KEY UPDATE score = IF(VALUES(time) < time, VALUES(score), score), time = LEAST(time, VALUES(time));"
+
+#define SELECT_LADDER_PAGE \
+"SELECT `name`, `score`, `tracks` FROM `raceladder` ORDER BY `score` DESC, `name` ASC LIMIT #, 10;"
+
+/* Results from racers flagged by the speed check wait here for staff */
+#define CREATE_RACESTATS_HELD_TABLE \
+" CREATE TABLE IF NOT EXISTS `racestats_held` (" \
+"  `id` int(11) NOT NULL auto_increment," \
 "  `time` int(11) NOT NULL default '0'," \
 "  `name` varchar(24) NOT NULL default ''," \
 "  `ship` int(10) NOT NULL default '0'," \
 "  `arena` char(24) NOT NULL default ''," \
 "  `date` timestamp NOT NULL," \
-"  PRIMARY KEY  (`time`)" \
+"  `evidence` varchar(128) NOT NULL default ''," \
+"  PRIMARY KEY  (`id`)," \
+"  KEY `arena` (`arena`)" \
 ");"
 
+#define INSERT_HELD \
+"INSERT INTO `racestats_held` (`time`, `name`, `ship`, `arena`, `date`, `evidence`) VALUES (#, ?, #, ?, NOW(), ?);"
+
+#define SELECT_HELD_LIST \
+"SELECT `id`, `time`, `name`, `ship`, `evidence` FROM `racestats_held` WHERE arena=? ORDER BY `id` ASC LIMIT 10;"
+
+#define SELECT_HELD \
+"SELECT `id`, `time`, `name`, `ship`, `evidence` FROM `racestats_held` WHERE id=# AND arena=?;"
+
+#define DELETE_HELD \
+"DELETE FROM `racestats_held` WHERE id=# AND arena=?;"
+
+/* Rows the DELETE just before it took out: 1 if this request got the result */
+#define SELECT_DELETED \
+"SELECT ROW_COUNT();"
+
 local override_key_t ok_Doors;
 
+/* Config sections holding each ship's settings */
+local const char *shipsections[] =
+{
+    "Warbird", "Javelin", "Spider", "Leviathan",
+    "Terrier", "Weasel", "Lancaster", "Shark"
+};
+
+/* Finished races and new ghost runs are handed to a writer thread, so
+ * the game never waits on the disk. A NULL job stops the thread. */
+typedef struct WriteJob
+{
+    char *line;           //JSON line for the export, NULL for a ghost run
+    char dir[256];        //ghost directory, made if missing
+    char path[256];       //ghost file
+    GhostHeader gh;
+    GhostSample *samples; //gh.count of them, freed once written
+} WriteJob;
+
+local MPQueue exportq;
+local pthread_t exportthd;
+local int exporting;      //1 = the writer thread is running
+local char exportfile[256];
+local long exportmax;
+
 local int allships[7];
+local int races;          //races started since the module loaded
 
 /************************************************************************/
 /*                              Prototypes                              */
@@ -95,9 +463,22 @@ local void Abort(Arena *arena, Player *host, int debug);
 local void Begin(Player *host, Arena *arena, const char *params);
 local void LegalShip(int ship, Arena *arena);
 local void CheckLegalShip(Arena *arena);
-local int TimeUp(void *p);
-local int RocketArea(void *p);
-local void LCheck(Arena *arena, Player *pe);
+local int TimeUp(void *a);
+local int WaitRecord(void *a);
+local void StartRace(Arena *arena);
+local void StartWave(Arena *arena);
+local void StartHeat(Arena *arena, Heat *heat);
+local int NextWave(void *a);
+local int StandingsTick(void *a);
+local void DrawStandings(Arena *arena, Player **top, int n);
+local void HeatDone(Arena *arena, Heat *heat);
+local int RocketArea(void *a);
+local void Bench(Player *p);
+local void Unbench(Player *p, int freq);
+local void AddRacer(Arena *arena, Heat *heat, Player *p);
+local Heat *RemoveRacer(Arena *arena, Player *p);
+local void ClearHeats(Arena *arena);
+local void LCheck(Arena *arena, Heat *heat);
 local void Stop(Arena* arena);
 
 //callbacks
@@ -105,492 +486,1662 @@ local void ShipFreqChange(Player *p, int newship, int oldship, int newfreq, int
 local void PlayerAction(Player *p, int action, Arena *arena);
 local char *suffix(int placement);
 local void EnterRegion(Player *p, Region *rgn, int x, int y, int entering);
+local void Position(Player *p, const struct C2SPosition *pos);
+local void Crossed(Player *p, int region, int raw, u32 ctime, ticks_t recv);
+local void Finish(Player *p, int time);
+
+//ghost runs
+local int GhostTick(void *a);
+local void StartGhost(Arena *arena);
+local void EndGhost(Arena *arena);
 
 /************************************************************************/
 /*                   Main Database Interaction                          */
 /************************************************************************/
 
+/* Migrate a table created before the surrogate id was added */
+local void db_checkschema(int status, db_res *res, void *clos)
+{
+    if (status != 0 || res == NULL)
+        return;
+
+    if (db->GetRowCount(res) < 1)
+        db->Query(NULL, NULL, 0, MIGRATE_RACESTATS_TABLE);
+}
+
+/* Seed the ladder from racestats the first time it is used */
+local void db_checkladder(int status, db_res *res, void *clos)
+{
+    if (status != 0 || res == NULL)
+        return;
+
+    db_row *row = db->GetRow(res);
+    if (row && atoi(db->GetField(row, 0)) == 0)
+    {
+        db->Query(NULL, NULL, 0, SEED_LADDER_TRACKS);
+        db->Query(NULL, NULL, 0, SEED_LADDER);
+    }
+}
+
 local void init_db(void)
 {
     //make sure the racestats table exists
     db->Query(NULL, NULL, 0, CREATE_RACESTATS_TABLE);
+    //and that it has been migrated to the current schema
+    db->Query(db_checkschema, NULL, 1, "SHOW COLUMNS FROM `racestats` LIKE 'id';");
+
+    //held results and the ladder are kept alongside it
+    db->Query(NULL, NULL, 0, CREATE_RACESTATS_HELD_TABLE);
+    db->Query(NULL, NULL, 0, CREATE_LADDER_TRACKS_TABLE);
+    db->Query(NULL, NULL, 0, CREATE_LADDER_TABLE);
+    db->Query(db_checkladder, NULL, 1, "SELECT COUNT(*) FROM `raceladder_tracks`;");
 }
 
+/* The track record, loaded when the arena is created. FindArena would
+ * miss an arena that is still being created, so the arena is looked up
+ * in the full list, and only taken if it has the same name still. */
 local void db_gettop(int status, db_res *res, void *clos)
 {
-    Player *p = (Player*)clos;
-    
-    int results = db->GetRowCount(res);
-    
-    db_row *row;
-    row = db->GetRow(res); //get first
-    
-    if (results < 1)
+    RecordQuery *query = clos;
+    Arena *arena = NULL, *a;
+    Link *link;
+
+    aman->Lock();
+    FOR_EACH_ARENA(a)
     {
-        //do nothing
+        if ((a == query->arena) && (!strcmp(a->name, query->name)))
+            arena = a;
     }
-    else
+    aman->Unlock();
+    free(query);
+
+    if (!arena || status != 0 || res == NULL)
+        return;
+
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+    db_row *row = db->GetRow(res); //get first
+
+    if (row)
     {
-        int seconds = atoi(db->GetField(row, 0));
-        int ship = atoi(db->GetField(row, 2)) + 1;
-        
-        Adata *adata = P_ARENA_DATA(p->arena, arenaKey);
-        adata->bestime = seconds;
-        adata->bestship = ship;
-        //adata->bestname = db->GetField(row, 1);
-        //adata->bestdate = db->GetField(row, 4);
+        adata->bestime = atoi(db->GetField(row, 0));
+        adata->bestship = atoi(db->GetField(row, 2)) + 1;
+        astrncpy(adata->bestname, db->GetField(row, 1), sizeof(adata->bestname));
     }
+
+    adata->recordready = 1;
 }
 
-/* Store the player's score into the database */
-local void SetScore(Player *p, float time)
+local void LoadRecord(Arena *arena)
 {
-    int ctime = (int)time;
-    //TODO: FIXME
-    //use pdata, store time, and compare
-    db->Query(db_gettop, p, 1, "SELECT * FROM `racestats` WHERE arena=? AND time=(SELECT MIN(time) FROM racestats WHERE arena=?);", p->arena->basename, p->arena->basename);
-    db->Query(NULL,NULL,0,"INSERT INTO `racestats` VALUES(#,?,#,?,NOW());", ctime, p->name, (int)p->p_ship, p->arena->basename);
-        
-    Pdata *pdata = PPDATA(p, playerKey);
-    if (ctime)
-    {
-        if (ctime < pdata->bestime || !pdata->bestime)
-        {
-            pdata->bestime = ctime;
-            Adata *adata = P_ARENA_DATA(p->arena, arenaKey);
-        
-            if (!adata->bestime)
-            {
-                chat->SendArenaSoundMessage(p->arena, 7, "%s sets the bar for this track with %.3f seconds on the clock!",
-                    p->name, time / 1000);
-                
-                adata->bestime = ctime;
-                adata->bestship = p->p_ship;
-                //adata->bestname = p->name;
-                //adata->bestdate = "today";
-            }
-            else if (ctime < adata->bestime)
-            {
-                float diff = adata->bestime - ctime;
-                chat->SendArenaSoundMessage(p->arena, 7, "%s broke the track record by %.3f seconds! Previous record was %.3f seconds (ship %i).",
-                    p->name, diff / 1000, (float)adata->bestime / 1000, adata->bestship); //set by %s (%s) in ship %i.
-                
-                adata->bestime = ctime;
-                adata->bestship = p->p_ship;
-                //adata->bestname = p->name;
-                //adata->bestdate = "today";
-            }
-        }
-    }
+    RecordQuery *query = malloc(sizeof(RecordQuery));
+    if (!query)
+        return;
+    query->arena = arena;
+    astrncpy(query->name, arena->name, sizeof(query->name));
+    db->Query(db_gettop, query, 1, SELECT_TRACK_BEST, arena->basename);
 }
 
-/* Returned result from ?best */
-local void db_best(int status, db_res *res, void *clos)
+/* Fold results into the ladder. The queries run in order
+ * after the results went into racestats, so the record is read with them
+ * in, and a new record rescores the track before anyone is credited.
+ * Without the cached record there is no telling whether it fell, so the
+ * track is rescored then too. */
+local void UpdateLadder(Arena *arena, RaceResult *results, int n)
 {
-    Player *p = (Player*)clos;
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+    int i;
 
-    int results = db->GetRowCount(res);
+    db->Query(NULL, NULL, 0, LADDER_RECORD, arena->basename);
+    if (adata->newrecord || !adata->recordready)
+    {
+        db->Query(NULL, NULL, 0, LADDER_RESCALE, arena->basename);
+        db->Query(NULL, NULL, 0, LADDER_RESCALE_TRACKS, arena->basename);
+        adata->newrecord = 0;
+    }
 
-    db_row *row;
-    row = db->GetRow(res); //get first
-    
-    if (results < 1)
+    for (i = 0; i < n; i++)
     {
-        chat->SendMessage(p, "You've never raced in here.");
+        RaceResult *r = &results[i];
+        unsigned int time = r->time;
+        if (!time)
+            continue;
+
+        db->Query(NULL, NULL, 0, LADDER_ENSURE, r->name);
+        db->Query(NULL, NULL, 0, LADDER_CREDIT, arena->basename, time, r->name, time);
+        db->Query(NULL, NULL, 0, LADDER_TRACK_BEST, r->name, arena->basename, time, time);
     }
-    else
+}
+
+/* Append a string to an export line as a quoted JSON string. Names are
+ * Latin-1, which maps straight onto the first 256 code points. */
+local int AppendJSON(char *buf, int pos, int len, const char *str)
+{
+    pos += snprintf(buf + pos, len - pos, "\"");
+    for (; *str && pos < len - 8; str++)
     {
-        int seconds = atoi(db->GetField(row, 0));
-        int ship = atoi(db->GetField(row, 2)) + 1;
-        chat->SendMessage(p, "Your best record: %.3f seconds using ship %i on %s",
-            (float)seconds / 1000, ship, db->GetField(row, 4));
-        
-        Pdata *pdata = PPDATA(p, playerKey);
-        pdata->bestime = seconds;
+        unsigned char c = *str;
+        if (c == '"' || c == '\\')
+        {
+            buf[pos++] = '\\';
+            buf[pos++] = c;
+        }
+        else if (c < 0x20 || c >= 0x80)
+            pos += snprintf(buf + pos, len - pos, "\\u%04x", c);
+        else
+            buf[pos++] = c;
     }
+    pos += snprintf(buf + pos, len - pos, "\"");
+    return pos;
 }
 
-/* Returned result from ?trackbest */
-local void db_tbest(int status, db_res *res, void *clos)
+/* Queue the buffered results as one line of the export */
+local void ExportRace(Arena *arena)
 {
-    Player *p = (Player*)clos;
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+    if (!adata->nresults || !exportfile[0])
+        return;
 
-    int results = db->GetRowCount(res);
+    //escaped strings take at most six bytes a character
+    int len = 256 + adata->nresults * (6 * sizeof(adata->results[0].name) + 12 * RACE_MAX_SPLITS + 96);
+    char *line = malloc(len);
+    if (!line)
+        return;
 
-    db_row *row;
-    row = db->GetRow(res); //get first
-    
-    if (results < 1)
+    int i, j, pos = snprintf(line, len, "{\"track\":");
+    pos = AppendJSON(line, pos, len, arena->basename);
+    pos += snprintf(line + pos, len - pos, ",\"date\":%ld,\"racers\":[", (long)time(NULL));
+
+    for (i = 0; i < adata->nresults; i++)
     {
-        chat->SendMessage(p, "No record found.");
+        RaceResult *r = &adata->results[i];
+        pos += snprintf(line + pos, len - pos, "%s{\"name\":", i ? "," : "");
+        pos = AppendJSON(line, pos, len, r->name);
+        pos += snprintf(line + pos, len - pos, ",\"ship\":%d,\"time\":%d,\"splits\":[", r->ship + 1, r->time);
+        for (j = 0; j < r->nsplits; j++)
+            pos += snprintf(line + pos, len - pos, "%s%d", j ? "," : "", r->splits[j]);
+        pos += snprintf(line + pos, len - pos, "]}");
     }
-    else
+    snprintf(line + pos, len - pos, "]}\n");
+
+    WriteJob *job = calloc(1, sizeof(WriteJob));
+    if (!job)
     {
-        int seconds = atoi(db->GetField(row, 0));
-        int ship = atoi(db->GetField(row, 2)) + 1;
-        chat->SendMessage(p, "Top Record: %.3f seconds, set by %s using ship %i on %s",
-            (float)seconds / 1000, db->GetField(row, 1), ship, db->GetField(row, 4));
-        
-        Adata *adata = P_ARENA_DATA(p->arena, arenaKey);
-        adata->bestime = seconds;
-        adata->bestship = ship;
-        //adata->bestname = db->GetField(row, 1);
-        //adata->bestdate = db->GetField(row, 4);
+        free(line);
+        return;
     }
+    job->line = line;
+    MPAdd(&exportq, job);
 }
 
-/************************************************************************/
-/*                          Interface Functions                         */
-/************************************************************************/
-
-local char* getOption(const char *string, char param)
+/* Write a ghost run to its file, by way of a temporary one. A ghost
+ * being replayed keeps its own mapping, so replacing is safe. */
+local void WriteGhost(WriteJob *job)
 {
-    if (!param)
-        return NULL;
+    char tmp[264];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", job->path);
+    mkdir(job->dir, 0755);
 
-    char search[4] = "-d(\0";
-    search[1] = param;
+    FILE *f = fopen(tmp, "wb");
+    if (!f)
+        return;
 
-    char *buf = strstr(string,search);
-    if (buf)
+    int ok = fwrite(&job->gh, sizeof(job->gh), 1, f) == 1 &&
+        fwrite(job->samples, sizeof(GhostSample), job->gh.count, f) == job->gh.count;
+
+    if (fclose(f) == 0 && ok)
+        rename(tmp, job->path);
+    else
+        remove(tmp);
+}
+
+/* Writer thread: write ghost runs, and append export lines as they come,
+ * moving the export file aside once it grows past ExportMaxSize. */
+local void *ExportThread(void *dummy)
+{
+    WriteJob *job;
+    FILE *f = NULL;
+
+    while ((job = MPRemove(&exportq)))
     {
-        char *result = calloc(64, sizeof(char));
-        int i = 3, j = 0;
-        for(; ((i < 67) && (j == 0)); i++)
+        char *line = job->line;
+        if (!line)
         {
-            if (buf[i] != ')')
-            {
-                result[i-3] = buf[i];
-            }
-            else
+            WriteGhost(job);
+            free(job->samples);
+            free(job);
+            continue;
+        }
+
+        if (!f)
+            f = fopen(exportfile, "a");
+
+        if (f)
+        {
+            fputs(line, f);
+            fflush(f);
+
+            if (exportmax > 0 && ftell(f) >= exportmax)
             {
-                j = 1;
+                char old[264];
+                snprintf(old, sizeof(old), "%s.1", exportfile);
+                fclose(f);
+                f = NULL;
+                rename(exportfile, old);
             }
         }
 
-        result[i-2] = '\0';
-        return result;
+        free(line);
+        free(job);
     }
-    else
-        return "";
+
+    if (f)
+        fclose(f);
+    return NULL;
 }
 
-local int getEmptyOption(const char *string, char param)
+local void StartExport(void)
 {
-    if (!param)
-        return 0;
+    const char *file = cfg->GetStr(GLOBAL, "Race", "ExportFile");
+    astrncpy(exportfile, file ? file : "race-results.jsonl", sizeof(exportfile));
+    exportmax = cfg->GetInt(GLOBAL, "Race", "ExportMaxSize", 10485760);
 
-    char search[3] = "-d\0";
-    search[1] = param;
+    MPInit(&exportq);
+    if (pthread_create(&exportthd, NULL, ExportThread, NULL) != 0)
+    {
+        //without a writer nothing may be queued, so export is off
+        lm->Log(L_ERROR, "<racing> can't start the export thread, race results won't be exported");
+        exportfile[0] = '\0';
+        MPDestroy(&exportq);
+        return;
+    }
+    exporting = 1;
+}
 
-    char *buf = strstr(string,search);
-    if (buf)
-        return 1;
-    else
-        return 0;
+local void StopExport(void)
+{
+    if (!exporting)
+        return;
+    exporting = 0;
+
+    //lines queued before this one are still written
+    MPAdd(&exportq, NULL);
+    pthread_join(exportthd, NULL);
+    MPDestroy(&exportq);
 }
 
+/* Write results to racestats with a single INSERT, and credit the ladder */
+local void StoreResults(Arena *arena, RaceResult *results, int n)
+{
+    //each row needs at most two hex-encoded strings and three numbers
+    int len = 128 + n * (4 * sizeof(results[0].name) + 64);
+    char *query = malloc(len);
+    if (!query)
+        return;
 
-/************************************************************************/
-/*                            Game Functions                           */
-/************************************************************************/
+    int i, pos = snprintf(query, len,
+        "INSERT INTO `racestats` (`time`, `name`, `ship`, `arena`, `date`) VALUES");
+    for (i = 0; i < n; i++)
+    {
+        RaceResult *r = &results[i];
+        pos += snprintf(query + pos, len - pos, "%s(%d,", i ? "," : "", r->time);
+        pos = AppendHex(query, pos, len, r->name);
+        pos += snprintf(query + pos, len - pos, ",%d,", r->ship);
+        pos = AppendHex(query, pos, len, arena->basename);
+        pos += snprintf(query + pos, len - pos, ",NOW())");
+    }
+    snprintf(query + pos, len - pos, ";");
 
-local void Abort(Arena *arena, Player *host, int debug)
+    db->Query(NULL, NULL, 0, query);
+    free(query);
+
+    UpdateLadder(arena, results, n);
+}
+
+/* Store the buffered results of a race, and export them as one race */
+local void FlushResults(Arena *arena)
 {
-    /* Reset values */
     Adata *adata = P_ARENA_DATA(arena, arenaKey);
-    adata->started = 0;
-    adata->lockships = 0;
-    adata->defaultship = 0;
-    adata->mystery = 0;
-    adata->starttime = 0;
-    adata->finished = 0;
+    if (!adata->nresults)
+        return;
 
-    chat->SendMessage(host, "Game aborted: Invalid syntax. Please type '?start' for more help.");
-    //chat->SendMessage(host, "Debug: %i", debug);
+    StoreResults(arena, adata->results, adata->nresults);
+    ExportRace(arena);
+    adata->nresults = 0;
 }
 
-local void Begin(Player *host, Arena *arena, const char *params)
+/* Drop the result buffer entirely */
+local void FreeResults(Arena *arena)
 {
-    /* Set the game as started */
     Adata *adata = P_ARENA_DATA(arena, arenaKey);
-    if (adata->started >= 1)
+    free(adata->results);
+    adata->results = NULL;
+    adata->nresults = 0;
+    adata->maxresults = 0;
+}
+
+/************************************************************************/
+/*                              Ghost Runs                              */
+/************************************************************************/
+
+local void GhostPath(Arena *arena, char *buf, int len)
+{
+    const char *dir = cfg->GetStr(arena->cfg, "Race", "GhostDir");
+    if (!dir || !*dir)
+        dir = "ghosts";
+    snprintf(buf, len, "%s/%s.ghost", dir, arena->basename);
+}
+
+/* Throw away a player's recorded position stream */
+local void ClearSamples(Player *p)
+{
+    Pdata *pdata = PPDATA(p, playerKey);
+    free(pdata->samples);
+    pdata->samples = NULL;
+    pdata->nsamples = 0;
+    pdata->maxsamples = 0;
+    pdata->recording = 0;
+}
+
+/* Sample a racer's position. This runs for every position packet of
+ * every racer, so it does nothing but compare and append. */
+local void RecordSample(Pdata *pdata, const struct C2SPosition *pos, int interval)
+{
+    if (!pdata->recording)
     {
-        chat->SendMessage(host, "There is already a game running. Please use ?stop to end the current game.");
+        pdata->startx = pdata->lastx = pos->x;
+        pdata->starty = pdata->lasty = pos->y;
+        pdata->lasttime = pos->time;
+        pdata->recording = 1;
         return;
     }
-    else
+
+    //client time is in hundredths of a second
+    int dt = (int)(pos->time - pdata->lasttime) * 10;
+    if (dt < interval)
+        return;
+
+    if (pdata->nsamples == pdata->maxsamples)
     {
-        adata->started = 1;
-    }        
-    /* Check top score */
-    db->Query(db_gettop, host, 1, "SELECT * FROM `racestats` WHERE arena=? AND time=(SELECT MIN(time) FROM racestats WHERE arena=?);", host->arena->basename, host->arena->basename);
+        int max = pdata->maxsamples ? pdata->maxsamples * 2 : 1024;
+        GhostSample *samples = realloc(pdata->samples, max * sizeof(GhostSample));
+        if (!samples)
+            return;
+        pdata->samples = samples;
+        pdata->maxsamples = max;
+    }
 
-    /* Get Game Options */
-    //mystery mode
-    if (getEmptyOption(params, 'm'))
-        adata->mystery = 1;
-    else
-        adata->mystery = 0;
+    GhostSample *gs = &pdata->samples[pdata->nsamples++];
+    gs->dx = pos->x - pdata->lastx;
+    gs->dy = pos->y - pdata->lasty;
+    gs->dt = dt > 65535 ? 65535 : dt;
+    gs->rotation = pos->rotation;
+    gs->status = pos->status;
 
-    //ships
+    pdata->lastx = pos->x;
+    pdata->lasty = pos->y;
+    pdata->lasttime = pos->time;
+}
+
+/* Save a record-setting run as this track's ghost */
+local void SaveGhost(Player *p, int time)
+{
+    Pdata *pdata = PPDATA(p, playerKey);
+    if (!pdata->nsamples)
+        return;
+
+    WriteJob *job = calloc(1, sizeof(WriteJob));
+    if (!job)
+        return;
+
+    const char *dir = cfg->GetStr(p->arena->cfg, "Race", "GhostDir");
+    astrncpy(job->dir, dir && *dir ? dir : "ghosts", sizeof(job->dir));
+    GhostPath(p->arena, job->path, sizeof(job->path));
+
+    memcpy(job->gh.magic, GHOST_MAGIC, sizeof(job->gh.magic));
+    job->gh.count = pdata->nsamples;
+    job->gh.time = time;
+    job->gh.ship = p->p_ship;
+    job->gh.x = pdata->startx;
+    job->gh.y = pdata->starty;
+    astrncpy(job->gh.name, p->name, sizeof(job->gh.name));
+
+    //the writer thread takes the samples over
+    job->samples = pdata->samples;
+    pdata->samples = NULL;
+    pdata->nsamples = 0;
+    pdata->maxsamples = 0;
+
+    if (exporting)
+        MPAdd(&exportq, job);
+    else
+    {
+        //no writer thread: better a pause than losing the record's ghost
+        WriteGhost(job);
+        free(job->samples);
+        free(job);
+    }
+}
+
+/* Take the ghost out of the arena and unmap its file */
+local void ReleaseGhost(Arena *arena)
+{
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+
+    if (adata->ghost)
+        fake->EndFaked(adata->ghost);
+    if (adata->ghostmap)
+        munmap(adata->ghostmap, adata->ghostlen);
+
+    adata->ghost = NULL;
+    adata->ghostmap = NULL;
+    adata->ghostlen = 0;
+}
+
+/* Stop replaying the ghost */
+local void EndGhost(Arena *arena)
+{
+    ml->ClearTimer(GhostTick, arena);
+    ReleaseGhost(arena);
+}
+
+/* Move the ghost along the record line to where it was at this point in
+ * the race. Runs ten times per second while a ghost is out. */
+local int GhostTick(void *a)
+{
+    Arena *arena = a;
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+
+    const GhostHeader *gh = adata->ghostmap;
+    const GhostSample *gs = (const GhostSample *)(gh + 1);
+    int elapsed = current_millis() - adata->ghoststart;
+    int dx = 0, dy = 0, dt = 0;
+
+    while (adata->ghostnext < (int)gh->count &&
+           adata->ghosttime + gs[adata->ghostnext].dt <= elapsed)
+    {
+        const GhostSample *cur = &gs[adata->ghostnext++];
+        adata->ghostx += cur->dx;
+        adata->ghosty += cur->dy;
+        adata->ghosttime += cur->dt;
+        dx += cur->dx;
+        dy += cur->dy;
+        dt += cur->dt;
+    }
+
+    if (dt)
+    {
+        const GhostSample *last = &gs[adata->ghostnext - 1];
+        struct C2SPosition pos;
+        memset(&pos, 0, sizeof(pos));
+        pos.type = C2S_POSITION;
+        pos.rotation = last->rotation;
+        pos.time = current_ticks();
+        pos.x = adata->ghostx;
+        pos.y = adata->ghosty;
+        //speeds are in pixels per ten seconds
+        pos.xspeed = dx * 10000 / dt;
+        pos.yspeed = dy * 10000 / dt;
+        pos.status = last->status;
+        pos.energy = 1000;
+        game->FakePosition(adata->ghost, &pos, sizeof(pos));
+    }
+
+    if (adata->ghostnext >= (int)gh->count)
+    {
+        ReleaseGhost(arena);
+        return 0;
+    }
+    return 1;
+}
+
+/* Map this track's ghost file and send out a fake player to drive it */
+local void StartGhost(Arena *arena)
+{
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+    if (adata->ghost || !cfg->GetInt(arena->cfg, "Race", "Ghost", 1))
+        return;
+
+    char path[256];
+    GhostPath(arena, path, sizeof(path));
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return;
+
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(GhostHeader))
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED)
+        return;
+
+    const GhostHeader *gh = map;
+    if (memcmp(gh->magic, GHOST_MAGIC, sizeof(gh->magic)) != 0 || gh->count == 0 ||
+        sizeof(GhostHeader) + (size_t)gh->count * sizeof(GhostSample) > (size_t)st.st_size ||
+        gh->ship < SHIP_WARBIRD || gh->ship > SHIP_SHARK)
+    {
+        munmap(map, st.st_size);
+        return;
+    }
+
+    char name[20];
+    snprintf(name, sizeof(name), "~%s", gh->name);
+    int freq = cfg->GetInt(arena->cfg, "Race", "GhostFreq", 8000);
+
+    adata->ghost = fake->CreateFakePlayer(name, arena, gh->ship, freq);
+    if (!adata->ghost)
+    {
+        munmap(map, st.st_size);
+        return;
+    }
+
+    adata->ghostmap = map;
+    adata->ghostlen = st.st_size;
+    adata->ghoststart = current_millis();
+    adata->ghostnext = 0;
+    adata->ghostx = gh->x;
+    adata->ghosty = gh->y;
+    adata->ghosttime = 0;
+
+    ml->SetTimer(GhostTick, 10, 10, arena, arena);
+}
+
+/************************************************************************/
+/*                             Race Results                             */
+/************************************************************************/
+
+/* Make room for one more result in the arena's buffer */
+local RaceResult *AddResult(Arena *arena, const char *name, int ship, int time)
+{
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+
+    if (adata->nresults == adata->maxresults)
+    {
+        int max = adata->maxresults ? adata->maxresults * 2 : 16;
+        RaceResult *results = realloc(adata->results, max * sizeof(RaceResult));
+        if (!results)
+            return NULL;
+        adata->results = results;
+        adata->maxresults = max;
+    }
+
+    RaceResult *r = &adata->results[adata->nresults++];
+    astrncpy(r->name, name, sizeof(r->name));
+    r->ship = ship;
+    r->time = time;
+    r->nsplits = 0;
+    return r;
+}
+
+/* Buffer the player's score until the end of the race */
+local void SetScore(Player *p, int ctime)
+{
+    float time = ctime;
+    Adata *adata = P_ARENA_DATA(p->arena, arenaKey);
+    Pdata *pdata = PPDATA(p, playerKey);
+
+    /* Flagged runs never touch the records until staff approve them */
+    if (pdata->flagged)
+    {
+        db->Query(NULL, NULL, 0, INSERT_HELD,
+            ctime, p->name, p->p_ship, p->arena->basename, pdata->evidence);
+        chat->SendMessage(p, "Your time has been held back for staff to review.");
+        return;
+    }
+
+    RaceResult *r = AddResult(p->arena, p->name, p->p_ship, ctime);
+    if (!r)
+        return;
+
+    r->nsplits = pdata->nsplits;
+    memcpy(r->splits, pdata->splits, pdata->nsplits * sizeof(int));
+
+    /* Announcements only ever compare against the cached track record,
+     * and say nothing if the race had to start before it loaded */
+    if (ctime)
+    {
+        if (ctime < pdata->bestime || !pdata->bestime)
+        {
+            pdata->bestime = ctime;
+
+            if (!adata->recordready)
+            {
+                //leave the cache as it is for the stored record to fill in
+            }
+            else if (!adata->bestime)
+            {
+                chat->SendArenaSoundMessage(p->arena, 7, "%s sets the bar for this track with %.3f seconds on the clock!",
+                    p->name, time / 1000);
+                SaveGhost(p, ctime);
+                
+                adata->newrecord = 1;
+                adata->bestime = ctime;
+                adata->bestship = p->p_ship + 1;
+                astrncpy(adata->bestname, p->name, sizeof(adata->bestname));
+                //adata->bestdate = "today";
+            }
+            else if (ctime < adata->bestime)
+            {
+                float diff = adata->bestime - ctime;
+                chat->SendArenaSoundMessage(p->arena, 7, "%s broke the track record by %.3f seconds! Previous record was %.3f seconds, set by %s (ship %i).",
+                    p->name, diff / 1000, (float)adata->bestime / 1000, adata->bestname, adata->bestship);
+                SaveGhost(p, ctime);
+
+                adata->newrecord = 1;
+                adata->bestime = ctime;
+                adata->bestship = p->p_ship + 1;
+                astrncpy(adata->bestname, p->name, sizeof(adata->bestname));
+                //adata->bestdate = "today";
+            }
+        }
+    }
+}
+
+/* Returned result from ?best */
+local void db_best(int status, db_res *res, void *clos)
+{
+    Player *p = (Player*)clos;
+
+    int results = db->GetRowCount(res);
+
+    db_row *row;
+    row = db->GetRow(res); //get first
+    
+    if (results < 1)
+    {
+        chat->SendMessage(p, "You've never raced in here.");
+    }
+    else
+    {
+        int seconds = atoi(db->GetField(row, 0));
+        int ship = atoi(db->GetField(row, 2)) + 1;
+        chat->SendMessage(p, "Your best record: %.3f seconds using ship %i on %s",
+            (float)seconds / 1000, ship, db->GetField(row, 3));
+        
+        Pdata *pdata = PPDATA(p, playerKey);
+        pdata->bestime = seconds;
+    }
+}
+
+/* Returned result from ?trackbest */
+local void db_tbest(int status, db_res *res, void *clos)
+{
+    Player *p = (Player*)clos;
+
+    int results = db->GetRowCount(res);
+
+    db_row *row;
+    row = db->GetRow(res); //get first
+    
+    if (results < 1)
+    {
+        chat->SendMessage(p, "No record found.");
+    }
+    else
+    {
+        int seconds = atoi(db->GetField(row, 0));
+        int ship = atoi(db->GetField(row, 2)) + 1;
+        chat->SendMessage(p, "Top Record: %.3f seconds, set by %s using ship %i on %s",
+            (float)seconds / 1000, db->GetField(row, 1), ship, db->GetField(row, 3));
+        
+        Adata *adata = P_ARENA_DATA(p->arena, arenaKey);
+        adata->bestime = seconds;
+        adata->bestship = ship;
+        astrncpy(adata->bestname, db->GetField(row, 1), sizeof(adata->bestname));
+        adata->recordready = 1;
+        //adata->bestdate = db->GetField(row, 3);
+    }
+}
+
+/* Returned result from ?raceladder */
+local void db_ladder(int status, db_res *res, void *clos)
+{
+    Player *p = (Player*)clos;
+    Pdata *pdata = PPDATA(p, playerKey);
+
+    if (status != 0 || res == NULL)
+        return;
+
+    int results = db->GetRowCount(res);
+    if (results < 1)
+    {
+        chat->SendMessage(p, "There is no one on that page of the ladder.");
+        return;
+    }
+
+    chat->SendMessage(p, "Racing ladder, page %i:", pdata->ladderpage + 1);
+
+    db_row *row;
+    int rank = pdata->ladderpage * 10;
+    while ((row = db->GetRow(res)))
+    {
+        rank++;
+        chat->SendMessage(p, "%4i. %-24s %7s points  %s tracks", rank,
+            db->GetField(row, 0), db->GetField(row, 1), db->GetField(row, 2));
+    }
+}
+
+/************************************************************************/
+/*                          Interface Functions                         */
+/************************************************************************/
+
+/* The value given for -param(value), "" if it isn't given. The result is
+ * always allocated, and the caller frees it. */
+local char* getOption(const char *string, char param)
+{
+    if (!param)
+        return NULL;
+
+    char search[4] = "-d(\0";
+    search[1] = param;
+
+    char *buf = strstr(string,search);
+    if (buf)
+    {
+        char *result = calloc(64, sizeof(char));
+        int i = 3, j = 0;
+        for(; ((i < 67) && (j == 0)); i++)
+        {
+            if (buf[i] != ')')
+            {
+                result[i-3] = buf[i];
+            }
+            else
+            {
+                j = 1;
+            }
+        }
+
+        result[i-2] = '\0';
+        return result;
+    }
+    else
+        return calloc(1, sizeof(char));
+}
+
+local int getEmptyOption(const char *string, char param)
+{
+    if (!param)
+        return 0;
+
+    char search[3] = "-d\0";
+    search[1] = param;
+
+    char *buf = strstr(string,search);
+    if (buf)
+        return 1;
+    else
+        return 0;
+}
+
+
+/************************************************************************/
+/*                            Game Functions                           */
+/************************************************************************/
+
+local void Abort(Arena *arena, Player *host, int debug)
+{
+    /* Reset values */
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+    adata->started = 0;
+    adata->lockships = 0;
+    adata->defaultship = 0;
+    adata->mystery = 0;
+    adata->starttime = 0;
+    adata->heatsize = 0;
+    adata->advance = 0;
+    adata->parallel = 0;
+
+    chat->SendMessage(host, "Game aborted: Invalid syntax. Please type '?start' for more help.");
+    //chat->SendMessage(host, "Debug: %i", debug);
+}
+
+local void Begin(Player *host, Arena *arena, const char *params)
+{
+    /* Set the game as started */
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+    if (adata->started >= 1)
+    {
+        chat->SendMessage(host, "There is already a game running. Please use ?stop to end the current game.");
+        return;
+    }
+    else
+    {
+        adata->started = 1;
+    }        
+    /* Get Game Options */
+    //mystery mode
+    if (getEmptyOption(params, 'm'))
+        adata->mystery = 1;
+    else
+        adata->mystery = 0;
+
+    //heats
+    char *option = getOption(params, 'h');
+    adata->heatsize = option ? atoi(option) : 0;
+    free(option);
+    option = getOption(params, 'a');
+    adata->advance = option ? atoi(option) : 0;
+    free(option);
+    adata->parallel = getEmptyOption(params, 'p');
+    if (!adata->advance)
+        adata->advance = 1;
+
+    if ((adata->heatsize && adata->heatsize < 2) || (adata->heatsize > RACE_MAX_RACERS) ||
+        (adata->advance < 1) || (adata->heatsize && adata->advance >= adata->heatsize))
+    {
+        Abort(arena, host, 5);
+        return;
+    }
+
+    //ships
     char *next, *string;
     string = getOption(params, 's');
 
-    int ii;
-    for (ii = 0; ii <= 8; ii++)
+    int ii;
+    for (ii = 0; ii <= 8; ii++)
+    {
+        allships[ii] = 0; //reset everyship
+    }
+
+
+    int length = string ? strlen(string) : 0;
+
+    if ((string != next) && (string) && (length >= 1))
+    {
+        if ((length % 2 == 0)  || (length > 15) || (!length))
+        {
+            free(string);
+            Abort(arena, host, 3);
+            return;
+        }
+        else
+        {
+            int i;
+            for (i = 0; i < length; i++)
+            {
+                if (string[i] != ',');
+                {
+                    char first[64];
+                    snprintf(first, sizeof(first) - 10, "%s", string + i * 2);
+                    first[1] = '\0';
+
+                    int legal = atoi(first) - 1;
+                    if (legal == -1)
+                        break;
+
+                    if (legal < 0 || legal > 7)
+                    {
+                        free(string);
+                        Abort(arena, host, 4);
+                        return;
+                    }
+                    else
+                    {
+                        LegalShip(legal, arena);
+                    }
+                    first[0] = '\0';
+                }
+            }
+            char first[64];
+            strncpy(first, string, 4);
+            first[1] = '\0';
+            adata->defaultship = atoi(first) - 1;
+            CheckLegalShip(arena);
+
+            adata->lockships = 1;
+        }
+    }
+    else
+    {
+        for (ii = 0; ii < 8; ii++)
+        {
+            allships[ii] = 1; //all ships are legal
+        }
+        adata->lockships = 0;
+    }
+    free(string);
+
+    /* Close the doors */
+    Player *d;
+    Link *link;
+
+    cs->ArenaOverride(arena, ok_Doors, 255);
+
+    pd->Lock();
+    FOR_EACH_PLAYER(d)
+    {
+        if (d->arena == arena)
+        {
+            cs->SendClientSettings(d);
+
+            Target target;
+            target.type = T_PLAYER;
+            target.u.p = d;
+            game->GivePrize(&target, PRIZE_WARP, 1);
+            game->ShipReset(&target);
+        }
+    }
+    pd->Unlock();
+
+    /* Get the name of the arena */
+    const char *longname;
+    longname = cfg->GetStr(arena->cfg, "Race", "LongName");
+    if ((!longname) || (strlen(longname) < 2))
+        longname = arena->name;
+
+    chat->SendArenaSoundMessage(arena, 2, "%s is starting in 20 seconds! Enter if you want to play!", longname);
+    if (adata->lockships)
+        chat->SendArenaMessage(arena, "Allowed ships: %s", string);
+    if (adata->mystery)
+        chat->SendArenaMessage(arena, "Mystery mode activated! Everyone gets cloak and stealth!");
+    if (adata->heatsize)
+        chat->SendArenaMessage(arena, "Heats of %i, the fastest %i from each heat %s to the final.",
+            adata->heatsize, adata->advance, adata->advance == 1 ? "goes" : "go");
+
+    CheckLegalShip(arena);
+
+    adata->started = 1;
+    /* Start the timer */
+    ml->SetTimer(TimeUp, 2000, 2000, arena, arena);
+}
+
+/* Set as legal ship  */
+local void LegalShip(int ship, Arena *arena)
+{
+    allships[ship] = 1;
+}
+
+/* Check if the player is in a legal ship */
+local void CheckLegalShip(Arena *arena)
+{
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+    if (!adata->lockships)
+        return;
+
+    int defaultship = adata->defaultship;
+
+    Player *g;
+    Link *link;
+    pd->Lock();
+    FOR_EACH_PLAYER(g)
+    {
+        if ((g->arena == arena) && g->p_ship != SHIP_SPEC)
+        {
+            int i, legal = 0;
+            for (i = 0; i < 8; i++)
+            {
+                if ((g->p_ship == i) && (allships[i] == 1))
+                    legal = 1;
+            }
+            if (!legal)
+                game->SetShip(g, defaultship);
+        }
+    }
+    pd->Unlock();
+}
+
+/* After 20 seconds have passed */
+local int TimeUp(void *a)
+{
+    Arena *arena = a;
+
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+    if (adata->started == 0)
+        return 0;
+
+    /* Announcements compare against the track record, so don't start
+     * without it unless the database takes too long */
+    if (!adata->recordready)
+    {
+        chat->SendArenaMessage(arena, "Waiting for the track record...");
+        adata->recordwait = current_ticks();
+        LoadRecord(arena);
+        ml->SetTimer(WaitRecord, 50, 50, arena, arena);
+        return 0;
+    }
+
+    StartRace(arena);
+    return 0;
+}
+
+/* Poll for the track record until it arrives or Race:RecordWaitTimeout runs out */
+local int WaitRecord(void *a)
+{
+    Arena *arena = a;
+
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+    if (adata->started == 0)
+        return 0;
+
+    int timeout = cfg->GetInt(arena->cfg, "Race", "RecordWaitTimeout", 500);
+    if (!adata->recordready && TICK_DIFF(current_ticks(), adata->recordwait) < timeout)
+        return 1;
+
+    StartRace(arena);
+    return 0;
+}
+
+/* Open the doors and get everyone racing */
+local void StartRace(Arena *arena)
+{
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+
+    CheckLegalShip(arena);
+
+    /* RocketArea checks every racer every other second. The map isn't
+     * loaded yet when the module attaches, and may have changed since
+     * the last race, so the region is flattened afresh for each race. */
+    free(adata->rocketbits);
+    adata->rocketbits = BuildRegionBits(arena, "rocket");
+
+    /* Everyone in a ship is racing */
+    Player *entrants[RACE_MAX_RACERS];
+    Player *g;
+    Link *link;
+    int i, n = 0;
+
+    pd->Lock();
+    FOR_EACH_PLAYER(g)
+    {
+        if ((g->arena == arena) && (g->p_ship != SHIP_SPEC) && IS_STANDARD(g) && (n < RACE_MAX_RACERS))
+            entrants[n++] = g;
+    }
+    pd->Unlock();
+
+    if (!n)
+    {
+        chat->SendArenaSoundMessage(arena, 1, "Game stopped. There were not enough players.");
+        Stop(arena);
+        return;
+    }
+
+    /* Deal the entrants out into heats, plus a final if there is more than one */
+    int nheats = 1;
+    if (adata->heatsize && n > adata->heatsize)
+        nheats = (n + adata->heatsize - 1) / adata->heatsize;
+    if (nheats > RACE_MAX_HEATS)
+        nheats = RACE_MAX_HEATS;
+
+    adata->nheats = nheats > 1 ? nheats + 1 : 1;
+    adata->heats = calloc(adata->nheats, sizeof(Heat));
+    if (!adata->heats)
+    {
+        adata->nheats = 0;
+        Stop(arena);
+        return;
+    }
+    if (nheats > 1)
+        adata->heats[nheats].final = 1;
+
+    adata->race = ++races;
+    for (i = 0; i < n; i++)
+        AddRacer(arena, &adata->heats[i % nheats], entrants[i]);
+
+    adata->starttime = current_millis();
+    adata->ghostinterval = cfg->GetInt(arena->cfg, "Race", "GhostInterval", 100);
+    adata->placed = 0;
+
+    adata->started = 2;
+
+    mm->RegCallback(CB_PLAYERACTION, PlayerAction, arena);
+    mm->RegCallback(CB_SHIPFREQCHANGE, ShipFreqChange, arena);
+    mm->RegCallback(CB_REGION, EnterRegion, arena);
+    mm->RegCallback(CB_PPK, Position, arena);
+
+    /* List who races in which heat */
+    for (i = 0; i < nheats && nheats > 1; i++)
+    {
+        Heat *heat = &adata->heats[i];
+        char names[200];
+        int j, pos = 0;
+
+        names[0] = '\0';
+        for (j = 0; j < heat->nracers && pos < (int)sizeof(names); j++)
+            pos += snprintf(names + pos, sizeof(names) - pos, "%s%s", j ? ", " : "", heat->racers[j]->name);
+
+        chat->SendArenaMessage(arena, "Heat %i: %s", i + 1, names);
+    }
+
+    StartWave(arena);
+    
+    ml->SetTimer(RocketArea, 200, 200, arena, arena);
+
+    /* Put up the standings, redrawn at most once a second */
+    //the standings are LVZ, so there are none without the objects module
+    adata->nstandings = obj ? cfg->GetInt(arena->cfg, "Race", "Standings", 0) : 0;
+    if (adata->nstandings > RACE_MAX_STANDINGS)
+        adata->nstandings = RACE_MAX_STANDINGS;
+    if (adata->nstandings > 0)
+    {
+        for (i = 0; i < adata->nstandings; i++)
+        {
+            adata->shownship[i] = -1;
+            adata->shownprogress[i] = -1;
+        }
+        adata->standingsdirty = 1;
+        ml->SetTimer(StandingsTick, 100, 100, arena, arena);
+    }
+    else
+        adata->nstandings = 0;
+}
+
+/* Start as many waiting heats as there are gates for, and sit everyone
+ * else out until their turn. */
+local void StartWave(Arena *arena)
+{
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+
+    int gates = adata->parallel ? cfg->GetInt(arena->cfg, "Race", "Gates", 1) : 1;
+    int i, j, running = 0;
+
+    for (i = 0; i < adata->nheats && running < gates; i++)
     {
-        allships[ii] = 0; //reset everyship
+        Heat *heat = &adata->heats[i];
+        if (heat->state != HEAT_WAITING)
+            continue;
+
+        //the final waits until every other heat is done
+        if (heat->final && running)
+            break;
+
+        if (!heat->nracers)
+        {
+            heat->state = HEAT_DONE;
+            continue;
+        }
+
+        heat->gate = running++;
+        StartHeat(arena, heat);
     }
 
+    //everyone still waiting has left
+    if (!running)
+    {
+        Stop(arena);
+        chat->SendArenaMessage(arena, "Race over!");
+        return;
+    }
 
-    int length = strlen(string);
+    for (i = 0; i < adata->nheats; i++)
+    {
+        Heat *heat = &adata->heats[i];
+        if (heat->state != HEAT_WAITING)
+            continue;
 
-    if ((string != next) && (string) && (length >= 1))
+        for (j = 0; j < heat->nracers; j++)
+            Bench(heat->racers[j]);
+    }
+
+    /* Open the Doors */
+    Player *g;
+    Link *link;
+
+    cs->ArenaOverride(arena, ok_Doors, 0);
+
+    pd->Lock();
+    FOR_EACH_PLAYER(g)
     {
-        if ((length % 2 == 0)  || (length > 15) || (!length))
+        if (g->arena == arena)
+            cs->SendClientSettings(g);
+    }
+    pd->Unlock();
+
+    /* Send out the track record's ghost */
+    StartGhost(arena);
+}
+
+/* Put a heat's racers on their gate and prize them */
+local void StartHeat(Arena *arena, Heat *heat)
+{
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+    int multi = adata->nheats > 1;
+    int i;
+
+    char key[16];
+    snprintf(key, sizeof(key), "Gate%dX", heat->gate + 1);
+    int x = cfg->GetInt(arena->cfg, "Race", key, 0);
+    snprintf(key, sizeof(key), "Gate%dY", heat->gate + 1);
+    int y = cfg->GetInt(arena->cfg, "Race", key, 0);
+    int freq = cfg->GetInt(arena->cfg, "Race", "HeatFreq", 0) + heat->gate;
+
+    heat->state = HEAT_RUNNING;
+    heat->starttime = current_millis();
+
+    for (i = 0; i < heat->nracers; i++)
+    {
+        Player *g = heat->racers[i];
+        Pdata *pdata = PPDATA(g, playerKey);
+
+        if (multi)
         {
-            Abort(arena, host, 3);
-            return;
+            //keep each gate to itself
+            if (pdata->benched)
+                Unbench(g, freq);
+            else if (g->p_freq != freq)
+                game->SetFreq(g, freq);
         }
-        else
-        {
-            int i;
-            for (i = 0; i < length; i++)
-            {
-                if (string[i] != ',');
-                {
-                    char first[64];
-                    snprintf(first, sizeof(first) - 10, "%s", string + i * 2);
-                    first[1] = '\0';
 
-                    int legal = atoi(first) - 1;
-                    if (legal == -1)
-                        break;
+        Target target;
+        target.type = T_PLAYER;
+        target.u.p = g;
 
-                    if (legal < 0 || legal > 7)
-                    {
-                        Abort(arena, host, 4);
-                        return;
-                    }
-                    else
-                    {
-                        LegalShip(legal, arena);
-                    }
-                    first[0] = '\0';
-                }
-            }
-            char first[64];
-            strncpy(first, string, 4);
-            first[1] = '\0';
-            adata->defaultship = atoi(first) - 1;
-            CheckLegalShip(arena);
+        game->ShipReset(&target); 
+        if (x && y)
+            game->WarpTo(&target, x, y);
+        pdata->windowlen = 0;
+        game->GivePrize(&target, PRIZE_ROCKET, 1);
 
-            adata->lockships = 1;
+        if (adata->mystery)
+        {
+            game->GivePrize(&target, PRIZE_CLOAK, 1);
+            game->GivePrize(&target, PRIZE_STEALTH, 1);
         }
     }
+
+    if (!multi)
+        chat->SendArenaSoundMessage(arena, 104, "Race started.");
+    else if (heat->final)
+        chat->SendArenaSoundMessage(arena, 104, "The final has started!");
     else
+        chat->SendArenaSoundMessage(arena, 104, "Heat %i started.", (int)(heat - adata->heats) + 1);
+}
+
+/* Once the doors have been shut for a while, run the next heats */
+local int NextWave(void *a)
+{
+    Arena *arena = a;
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+
+    if (adata->started == 2)
+        StartWave(arena);
+
+    return 0;
+}
+
+/* Everyone in a heat has finished or dropped out */
+local void HeatDone(Arena *arena, Heat *heat)
+{
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+    int i, k;
+
+    heat->state = HEAT_DONE;
+
+    /* Move the fastest finishers into the final */
+    if (adata->nheats > 1 && !heat->final)
     {
-        for (ii = 0; ii < 8; ii++)
+        Heat *final = &adata->heats[adata->nheats - 1];
+
+        for (k = 0; k < adata->advance; k++)
         {
-            allships[ii] = 1; //all ships are legal
+            Player *best = NULL;
+            int besttime = 0;
+
+            for (i = 0; i < heat->nracers; i++)
+            {
+                Pdata *gdata = PPDATA(heat->racers[i], playerKey);
+                if (gdata->won && (!best || gdata->finishtime < besttime))
+                {
+                    best = heat->racers[i];
+                    besttime = gdata->finishtime;
+                }
+            }
+
+            if (!best)
+                break;
+
+            chat->SendArenaMessage(arena, "%s advances to the final with %.3f seconds.", best->name, (float)besttime / 1000);
+            RemoveRacer(arena, best);
+            AddRacer(arena, final, best);
+            Bench(best);
         }
-        adata->lockships = 0;
     }
 
-    /* Close the doors */
-    Player *d;
+    /* Whoever is left in this heat is done racing */
+    while (heat->nracers)
+        RemoveRacer(arena, heat->racers[heat->nracers - 1]);
+
+    int waiting = 0;
+    for (i = 0; i < adata->nheats; i++)
+    {
+        if (adata->heats[i].state == HEAT_RUNNING)
+            return;
+        if (adata->heats[i].state == HEAT_WAITING && adata->heats[i].nracers)
+            waiting = 1;
+    }
+
+    if (!waiting)
+    {
+        Stop(arena);
+        chat->SendArenaMessage(arena, "Race over!");
+        return;
+    }
+
+    /* Close the doors until the next heats go */
+    Player *g;
     Link *link;
 
     cs->ArenaOverride(arena, ok_Doors, 255);
 
     pd->Lock();
-    FOR_EACH_PLAYER(d)
+    FOR_EACH_PLAYER(g)
     {
-        if (d->arena == arena)
-        {
-            cs->SendClientSettings(d);
-
-            Target target;
-            target.type = T_PLAYER;
-            target.u.p = d;
-            game->GivePrize(&target, PRIZE_WARP, 1);
-            game->ShipReset(&target);
-        }
+        if (g->arena == arena)
+            cs->SendClientSettings(g);
     }
     pd->Unlock();
 
-    /* Get the name of the arena */
-    const char *longname;
-    longname = cfg->GetStr(arena->cfg, "Race", "LongName");
-    if ((!longname) || (strlen(longname) < 2))
-        longname = arena->name;
-
-    chat->SendArenaSoundMessage(arena, 2, "%s is starting in 20 seconds! Enter if you want to play!", longname);
-    if (adata->lockships)
-        chat->SendArenaMessage(arena, "Allowed ships: %s", string);
-    if (adata->mystery)
-        chat->SendArenaMessage(arena, "Mystery mode activated! Everyone gets cloak and stealth!");
-
-    CheckLegalShip(arena);
+    int delay = cfg->GetInt(arena->cfg, "Race", "HeatDelay", 1000);
+    chat->SendArenaSoundMessage(arena, 2, "The next heat starts in %i seconds!", delay / 100);
+    ml->SetTimer(NextWave, delay, delay, arena, arena);
+}
 
-    adata->started = 1;
-    /* Start the timer */
-    ml->SetTimer(TimeUp, 2000, 2000, host, arena);
+/* Is racer a ahead of racer b? Finishers go by placing, everyone else by
+ * checkpoints taken, then by who took their latest one first. */
+local int Ahead(Pdata *a, Pdata *b)
+{
+    if (a->won || b->won)
+        return a->won && (!b->won || a->place < b->place);
+    if (a->nsplits != b->nsplits)
+        return a->nsplits > b->nsplits;
+    return a->nsplits && a->splits[a->nsplits - 1] < b->splits[b->nsplits - 1];
 }
 
-/* Set as legal ship  */
-local void LegalShip(int ship, Arena *arena)
+/* Redraw the standings if anything changed since the last tick. Racers
+ * crossing checkpoints only mark them dirty, so however busy the race
+ * is the arena gets at most one batch of toggles a second. */
+local int StandingsTick(void *a)
 {
-    allships[ship] = 1;
+    Arena *arena = a;
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+
+    if (!adata->standingsdirty)
+        return 1;
+    adata->standingsdirty = 0;
+
+    /* Keep the leaders in a short sorted list */
+    Player *top[RACE_MAX_STANDINGS];
+    int slots = adata->nstandings;
+    int n = 0, h, i, j;
+
+    for (h = 0; h < adata->nheats; h++)
+    {
+        Heat *heat = &adata->heats[h];
+        if (heat->state != HEAT_RUNNING)
+            continue;
+
+        for (i = 0; i < heat->nracers; i++)
+        {
+            Player *g = heat->racers[i];
+            Pdata *gdata = PPDATA(g, playerKey);
+
+            if (n < slots)
+                n++;
+            else if (!Ahead(gdata, PPDATA(top[n - 1], playerKey)))
+                continue;
+
+            for (j = n - 1; j > 0 && Ahead(gdata, PPDATA(top[j - 1], playerKey)); j--)
+                top[j] = top[j - 1];
+            top[j] = g;
+        }
+    }
+
+    DrawStandings(arena, top, n);
+    return 1;
 }
 
-/* Check if the player is in a legal ship */
-local void CheckLegalShip(Arena *arena)
+/* Show the given racers in the standings, toggling only the objects
+ * that differ from what is up now. n = 0 clears the overlay. */
+local void DrawStandings(Arena *arena, Player **top, int n)
 {
     Adata *adata = P_ARENA_DATA(arena, arenaKey);
-    if (!adata->lockships)
-        return;
+    int base = cfg->GetInt(arena->cfg, "Race", "StandingsObject", 1000);
 
-    int defaultship = adata->defaultship;
+    short ids[RACE_MAX_STANDINGS * 4];
+    char ons[RACE_MAX_STANDINGS * 4];
+    int i, count = 0;
 
-    Player *g;
-    Link *link;
-    pd->Lock();
-    FOR_EACH_PLAYER(g)
+    for (i = 0; i < adata->nstandings; i++)
     {
-        if ((g->arena == arena) && g->p_ship != SHIP_SPEC)
+        int slot = base + i * 100;
+        int ship = -1, progress = -1;
+
+        if (i < n && top[i]->p_ship >= 0 && top[i]->p_ship < SHIP_SPEC)
         {
-            int i, legal = 0;
-            for (i = 0; i < 8; i++)
+            Pdata *gdata = PPDATA(top[i], playerKey);
+            ship = top[i]->p_ship;
+            progress = gdata->won ? 9 : 10 + gdata->nsplits;
+        }
+
+        if (ship != adata->shownship[i])
+        {
+            if (adata->shownship[i] >= 0)
             {
-                if ((g->p_ship == i) && (allships[i] == 1))
-                    legal = 1;
+                ids[count] = slot + adata->shownship[i];
+                ons[count++] = 0;
             }
-            if (!legal)
-                game->SetShip(g, defaultship);
+            if (ship >= 0)
+            {
+                ids[count] = slot + ship;
+                ons[count++] = 1;
+            }
+            adata->shownship[i] = ship;
+        }
+
+        if (progress != adata->shownprogress[i])
+        {
+            if (adata->shownprogress[i] >= 0)
+            {
+                ids[count] = slot + adata->shownprogress[i];
+                ons[count++] = 0;
+            }
+            if (progress >= 0)
+            {
+                ids[count] = slot + progress;
+                ons[count++] = 1;
+            }
+            adata->shownprogress[i] = progress;
         }
     }
-    pd->Unlock();
+
+    if (count)
+    {
+        Target target;
+        target.type = T_ARENA;
+        target.u.arena = arena;
+        obj->ToggleSet(&target, ids, ons, count);
+    }
 }
 
-/* After 20 seconds have passed */
-local int TimeUp(void *p)
+/* Flatten a region into a bitmap once, so that testing a point is a
+ * shift and a mask instead of a trip through mapdata. */
+local u32 *BuildRegionBits(Arena *arena, const char *name)
 {
-    Player *host = p;
-    Arena *arena = host->arena;
+    Region *rgn = mapdata->FindRegionByName(arena, name);
+    if (!rgn)
+        return NULL;
 
-    Adata *adata = P_ARENA_DATA(arena, arenaKey);
-    if (adata->started == 0)
-        return 0;
+    u32 *bits = calloc(BITMAP_WORDS, sizeof(u32));
+    if (!bits)
+        return NULL;
 
-    /* Open the Doors and prize the players */
-    Player *g;
-    Link *link;
+    int x, y;
+    for (y = 0; y < 1024; y++)
+        for (x = 0; x < 1024; x++)
+            if (mapdata->Contains(rgn, x, y))
+                bits[(y << 5) | (x >> 5)] |= 1u << (x & 31);
 
-    cs->ArenaOverride(arena, ok_Doors, 0);
+    return bits;
+}
 
-    pd->Lock();
-    FOR_EACH_PLAYER(g)
+/* Collect every racer in a running heat who is inside a bitmap, in one
+ * pass over the rosters. Returns how many were found. */
+local int ClassifyRacers(Arena *arena, const u32 *bits, Player **found, int max)
+{
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+    int h, i, n = 0;
+
+    for (h = 0; h < adata->nheats; h++)
     {
-        if (g->arena == arena)
+        Heat *heat = &adata->heats[h];
+        if (heat->state != HEAT_RUNNING)
+            continue;
+
+        for (i = 0; i < heat->nracers && n < max; i++)
         {
-            cs->SendClientSettings(g);
+            Player *g = heat->racers[i];
+            int x = g->position.x >> 4;
+            int y = g->position.y >> 4;
+            if (IN_BITMAP(bits, x, y))
+                found[n++] = g;
+        }
+    }
 
-            if (g->p_ship != SHIP_SPEC)
-            {
-                Target target;
-                target.type = T_PLAYER;
-                target.u.p = g;
-                
-                game->ShipReset(&target); 
-                game->GivePrize(&target, PRIZE_ROCKET, 1);
+    return n;
+}
 
-                if (adata->mystery)
-                {
-                    game->GivePrize(&target, PRIZE_CLOAK, 1);
-                    game->GivePrize(&target, PRIZE_STEALTH, 1);
-                }
+/* If a player is in a rocket area, prize him */
+local int RocketArea(void *a)
+{
+    Arena *arena = a;
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
 
-                Pdata *pdata = PPDATA(g, playerKey);
-                pdata->won = 0;
-            }
-        }
+    if (!adata->rocketbits)
+        return 0;
+    
+    Player *inside[RACE_MAX_RACERS];
+    int i, n = ClassifyRacers(arena, adata->rocketbits, inside, RACE_MAX_RACERS);
+
+    for (i = 0; i < n; i++)
+    {
+        Target target;
+        target.type = T_PLAYER;
+        target.u.p = inside[i];
+        game->GivePrize(&target, PRIZE_ROCKET, 1);
     }
-    pd->Unlock();
+    
+    return 1;
+}
 
+/* Sit a racer out in spec until their heat starts */
+local void Bench(Player *p)
+{
+    Pdata *pdata = PPDATA(p, playerKey);
 
-    CheckLegalShip(arena);
+    if (pdata->benched)
+        return;
 
-    chat->SendArenaSoundMessage(arena, 104, "Race started.");
-    adata->starttime = current_millis();
+    pdata->benched = 1;
+    if (p->p_ship != SHIP_SPEC)
+        pdata->benchship = p->p_ship;
+    game->SetShipAndFreq(p, SHIP_SPEC, p->arena->specfreq);
+}
 
-    adata->started = 2;
+/* Bring a benched racer back in the ship they entered with */
+local void Unbench(Player *p, int freq)
+{
+    Pdata *pdata = PPDATA(p, playerKey);
+
+    pdata->benched = 0;
+    game->SetShipAndFreq(p, pdata->benchship, freq);
+}
+
+/* Put a player on a heat's roster */
+local void AddRacer(Arena *arena, Heat *heat, Player *p)
+{
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+    Pdata *pdata = PPDATA(p, playerKey);
+
+    if (pdata->racing || heat->nracers >= RACE_MAX_RACERS)
+        return;
+
+    pdata->racing = 1;
+    adata->standingsdirty = 1;
+    pdata->heat = heat - adata->heats;
+    pdata->slot = heat->nracers;
+    heat->racers[heat->nracers++] = p;
+    heat->remaining++;
+    adata->entrants++;
+
+    pdata->won = 0;
+    pdata->finishtime = 0;
+    pdata->windowlen = 0;
+    pdata->flagged = 0;
+    pdata->recording = 0;
+    pdata->nsamples = 0;
+    pdata->pending = 0;
+    pdata->nsplits = 0;
+    pdata->ppkrecv = 0;
+}
+
+/* Take a player off their heat's roster, returning that heat */
+local Heat *RemoveRacer(Arena *arena, Player *p)
+{
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+    Pdata *pdata = PPDATA(p, playerKey);
 
-    mm->RegCallback(CB_PLAYERACTION, PlayerAction, arena);
-    mm->RegCallback(CB_SHIPFREQCHANGE, ShipFreqChange, arena);
-    mm->RegCallback(CB_REGION, EnterRegion, arena);
-    
-    ml->SetTimer(RocketArea, 200, 200, host, arena);
+    if (!pdata->racing)
+        return NULL;
 
-    return 0;
+    Heat *heat = &adata->heats[pdata->heat];
+    if (!pdata->won)
+        heat->remaining--;
+
+    //fill the hole with the last racer
+    Player *last = heat->racers[--heat->nracers];
+    heat->racers[pdata->slot] = last;
+    PPDATA(last, playerKey)->slot = pdata->slot;
+    adata->entrants--;
+    adata->standingsdirty = 1;
+
+    pdata->racing = 0;
+    pdata->pending = 0;
+    ClearSamples(p);
+    return heat;
 }
 
-/* If a player is in a rocket area, prize him */
-local int RocketArea(void *p)
+/* Empty every roster and forget the heats */
+local void ClearHeats(Arena *arena)
 {
-    Player *host = p;
-    Region *rgn;
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+    int h, i;
 
-    rgn = mapdata->FindRegionByName(host->arena, "rocket");
-    
-    if (!rgn)
-        return 0;
-    
-    Player *g;
-    Link *link;
-    
-    pd->Lock();
-    FOR_EACH_PLAYER(g)
+    for (h = 0; h < adata->nheats; h++)
     {
-        if (g->arena == host->arena)
+        Heat *heat = &adata->heats[h];
+        for (i = 0; i < heat->nracers; i++)
         {
-            int x = g->position.x >> 4;
-            int y = g->position.y >> 4;
-            if ((g->p_ship != SHIP_SPEC) && (mapdata->Contains(rgn, x, y)))
-            {
-                Target target;
-                target.type = T_PLAYER;
-                target.u.p = g;
-                game->GivePrize(&target, PRIZE_ROCKET, 1);
-            }
+            Pdata *pdata = PPDATA(heat->racers[i], playerKey);
+            ClearSamples(heat->racers[i]);
+            pdata->racing = 0;
+            pdata->benched = 0;
         }
     }
-    pd->Unlock();
-    
-    return 1;
+
+    free(adata->heats);
+    adata->heats = NULL;
+    adata->nheats = 0;
+    adata->entrants = 0;
 }
 
 /* Check if players have left the arena or specced. */
-local void LCheck(Arena *arena, Player *pe)
+local void LCheck(Arena *arena, Heat *heat)
 {
-    Player *p = NULL;
-    Link *link;
-    int i = 0;
-    pd->Lock();
-    FOR_EACH_PLAYER(p)
-    {
-        if ((p->arena == arena) && (p->p_ship != SHIP_SPEC) && (p != pe))
-        {
-            i++;
-        }
-    }
-    pd->Unlock();
-    if (i == 0)
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+    if (adata->started != 2)
+        return;
+
+    if (adata->entrants == 0)
     {
         chat->SendArenaSoundMessage(arena, 1, "Game stopped. There were not enough players.");
         Stop(arena);
     }
+    else if (heat && heat->state == HEAT_RUNNING && heat->remaining == 0)
+    {
+        HeatDone(arena, heat);
+    }
 }
 
 /* End the current game */
@@ -618,6 +2169,9 @@ local void Stop(Arena* arena)
     }
     pd->Unlock();
 
+    /* Store everyone who finished */
+    FlushResults(arena);
+
     /* Reset arena data */
     Adata *adata = P_ARENA_DATA(arena, arenaKey);
     adata->started = 0;
@@ -625,14 +2179,29 @@ local void Stop(Arena* arena)
     adata->defaultship = 0;
     adata->mystery = 0;
     adata->starttime = 0;
-    adata->finished = 0;
+    adata->heatsize = 0;
+    adata->advance = 0;
+    adata->parallel = 0;
+
+    /* Take down the standings */
+    ml->ClearTimer(StandingsTick, arena);
+    DrawStandings(arena, NULL, 0);
+    adata->nstandings = 0;
+
+    /* Empty the rosters, dropping whatever was recorded */
+    ClearHeats(arena);
 
     /* Clear timers and unregister callbacks */
     ml->ClearTimer(TimeUp, arena);
+    ml->ClearTimer(WaitRecord, arena);
+    ml->ClearTimer(NextWave, arena);
     ml->ClearTimer(RocketArea, arena);
     mm->UnregCallback(CB_PLAYERACTION, PlayerAction, arena);
     mm->UnregCallback(CB_SHIPFREQCHANGE, ShipFreqChange, arena);
     mm->UnregCallback(CB_REGION, EnterRegion, arena);
+    mm->UnregCallback(CB_PPK, Position, arena);
+
+    EndGhost(arena);
 }
 
 /************************************************************************/
@@ -642,13 +2211,46 @@ local void Stop(Arena* arena)
 /* Check if a player spectates the game. */
 local void ShipFreqChange(Player *p, int newship, int oldship, int newfreq, int oldfreq)
 {
+    if (p->type == T_FAKE)
+        return;
+
+    Pdata *pdata = PPDATA(p, playerKey);
+
+    if (pdata->benched)
+    {
+        //benched racers wait in spec for their heat
+        if (p->p_ship != SHIP_SPEC)
+        {
+            chat->SendMessage(p, "Your heat has not started yet.");
+            game->SetShipAndFreq(p, SHIP_SPEC, p->arena->specfreq);
+        }
+        return;
+    }
+
     if (p->p_ship == SHIP_SPEC)
     {
-        LCheck(p->arena, p);
+        Heat *heat = RemoveRacer(p->arena, p);
+        LCheck(p->arena, heat);
     }
     else
     {
         Adata *adata = P_ARENA_DATA(p->arena, arenaKey);
+
+        //a new ship has a new top speed
+        if (oldship != newship)
+            pdata->windowlen = 0;
+
+        //late entries can still race, unless the race is run in heats,
+        //but those who already finished it keep their one result
+        if (oldship == SHIP_SPEC && adata->started == 2 && IS_STANDARD(p) &&
+            adata->nheats == 1 && adata->heats[0].state == HEAT_RUNNING)
+        {
+            if (pdata->finishedrace == adata->race)
+                chat->SendMessage(p, "You have already finished this race.");
+            else
+                AddRacer(p->arena, &adata->heats[0], p);
+        }
+
         if (!adata->lockships)
             return;
 
@@ -675,16 +2277,21 @@ local void ShipFreqChange(Player *p, int newship, int oldship, int newfreq, int
 /* Check if a player leaves the arena. */
 local void PlayerAction(Player *p, int action, Arena *arena)
 {
+    if (p->type == T_FAKE)
+        return;
+
     if ((action == PA_DISCONNECT) || (action == PA_LEAVEARENA))
-        LCheck(arena, p);
+    {
+        Heat *heat = RemoveRacer(arena, p);
+        PPDATA(p, playerKey)->benched = 0;
+        LCheck(arena, heat);
+    }
 
     /* Send a new player the status of the game. */
     if (action == PA_ENTERARENA)
     {
-        db->Query(db_best, p, 1, "SELECT * FROM `racestats` WHERE name=? AND arena=? AND time=(SELECT MIN(time) FROM racestats WHERE name=? AND arena=?);",
-            p->name, p->arena->basename, p->name, p->arena->basename);
-        
-        db->Query(db_gettop, p, 1, "SELECT * FROM `racestats` WHERE arena=? AND time=(SELECT MIN(time) FROM racestats WHERE arena=?);", p->arena->basename, p->arena->basename);
+        db->Query(db_best, p, 1, SELECT_PERSONAL_BEST,
+            p->arena->basename, p->name);
     }
 }
 
@@ -701,63 +2308,268 @@ local char *suffix(int placement)
         return "th";
 }
 
+/* The fastest a racer may legally go: their ship's top speed, or a
+ * rocket's if that is faster, plus Race:SpeedMargin. 0 = don't check. */
+local int SpeedCap(Player *p)
+{
+    if (p->p_ship < 0 || p->p_ship >= SHIP_SPEC)
+        return 0;
+
+    int top = cfg->GetInt(p->arena->cfg, shipsections[p->p_ship], "MaximumSpeed", 0);
+    int rocket = cfg->GetInt(p->arena->cfg, "Rocket", "RocketSpeed", 0);
+    int margin = cfg->GetInt(p->arena->cfg, "Race", "SpeedMargin", 20);
+
+    if (rocket > top)
+        top = rocket;
+    return top * (100 + margin) / 100;
+}
+
+/* Check the speed across the racer's last RACE_WINDOW positions. Single
+ * packets are too jittery to judge, so only segments of half a second
+ * or more count. Warps (the flash bit) start a new window. */
+local void CheckSpeed(Player *p, Pdata *pdata, const struct C2SPosition *pos)
+{
+    if (pos->status & STATUS_FLASH)
+        pdata->windowlen = 0;
+
+    if (!pdata->windowlen)
+    {
+        pdata->windowpos = 0;
+        pdata->speedcap = SpeedCap(p);
+    }
+
+    if (pdata->windowlen == RACE_WINDOW && pdata->speedcap && !pdata->flagged)
+    {
+        WindowPos *old = &pdata->window[pdata->windowpos];
+        int dt = (int)(pos->time - old->time); //hundredths of a second
+
+        if (dt >= 50)
+        {
+            double dx = pos->x - old->x;
+            double dy = pos->y - old->y;
+            //speeds are in pixels per 10 seconds
+            int speed = (int)(sqrt(dx * dx + dy * dy) * 1000 / dt);
+
+            if (speed > pdata->speedcap)
+            {
+                pdata->flagged = 1;
+                snprintf(pdata->evidence, sizeof(pdata->evidence),
+                    "speed %d over %d ms from (%d,%d) to (%d,%d), limit %d",
+                    speed, dt * 10, old->x, old->y, pos->x, pos->y, pdata->speedcap);
+
+                chat->SendModMessage("(Race) {%s} %s flagged: %s", p->arena->name, p->name, pdata->evidence);
+                lm->LogP(L_WARN, "racing", p, "flagged: %s", pdata->evidence);
+            }
+        }
+    }
+
+    WindowPos *w = &pdata->window[pdata->windowpos];
+    w->x = pos->x;
+    w->y = pos->y;
+    w->time = pos->time;
+    pdata->windowpos = (pdata->windowpos + 1) % RACE_WINDOW;
+    if (pdata->windowlen < RACE_WINDOW)
+        pdata->windowlen++;
+}
+
+/* Remember the timestamp of each racer's latest position, sample it for
+ * their ghost run, and time any region that was waiting on it. */
+local void Position(Player *p, const struct C2SPosition *pos)
+{
+    Adata *adata = P_ARENA_DATA(p->arena, arenaKey);
+    Pdata *pdata = PPDATA(p, playerKey);
+
+    if (adata->started != 2 || !pdata->racing || pdata->won)
+        return;
+    if (adata->heats[pdata->heat].state != HEAT_RUNNING)
+        return;
+
+    pdata->ppktime = pos->time;
+    pdata->ppkrecv = current_ticks();
+
+    CheckSpeed(p, pdata, pos);
+    RecordSample(pdata, pos, adata->ghostinterval);
+
+    /* This packet only put them in the region if it came in the same
+     * tick; a later one says nothing about the crossing, so fall back on
+     * the last packet from before it */
+    if (pdata->pending)
+    {
+        int region = pdata->pending;
+        pdata->pending = 0;
+        if (pdata->pendingtick == pdata->ppkrecv)
+            Crossed(p, region, pdata->pendingraw, pos->time, pdata->ppkrecv);
+        else
+            Crossed(p, region, pdata->pendingraw, pdata->pendingctime, pdata->pendingrecv);
+    }
+}
+
+/* How many milliseconds to take off a race time measured on the server.
+ * The crossing packet's client timestamp, mapped onto the server clock
+ * with the best time sync sample and compared with when it was handled
+ * (recv), shows how late it arrived: the upstream delay. The doors
+ * opened late for the racer by the downstream delay, which isn't in
+ * that, so half the average round trip is added for it. recv = 0 means
+ * no packet is known, and only the downstream half is taken off. */
+local int Correction(Player *p, u32 ctime, ticks_t recv)
+{
+    struct TimeSyncHistory history;
+    struct PingSummary ping;
+    int i, found = 0, offset = 0;
+
+    lagq->QueryTimeSyncHistory(p, &history);
+    for (i = 0; i < TIME_SYNC_SAMPLES; i++)
+    {
+        if (!history.servertime[i] && !history.clienttime[i])
+            continue;
+
+        //the smallest offset is the sync packet that was delayed least
+        int o = (int)(history.servertime[i] - history.clienttime[i]);
+        if (!found || o < offset)
+            offset = o;
+        found = 1;
+    }
+
+    lagq->QueryPPing(p, &ping);
+
+    int late = 0;
+    if (found && recv)
+    {
+        //both clocks are in hundredths of a second
+        late = TICK_DIFF(recv, ctime + offset) * 10;
+        if (late < 0)
+            late = 0;
+    }
+
+    int max = cfg->GetInt(p->arena->cfg, "Race", "MaxCorrection", 1000);
+    int correction = late + (ping.avg > 0 ? ping.avg / 2 : 0);
+    return correction > max ? max : correction;
+}
+
+/* A racer entered the finish (-1) or a checkpoint (n), and we now know
+ * the client timestamp of the packet that put them there. */
+local void Crossed(Player *p, int region, int raw, u32 ctime, ticks_t recv)
+{
+    Pdata *pdata = PPDATA(p, playerKey);
+
+    int time = raw - Correction(p, ctime, recv);
+    if (time < 1)
+        time = 1;
+
+    if (region > 0)
+    {
+        lm->LogP(L_INFO, "racing", p, "checkpoint %d: raw %d ms, corrected %d ms", region, raw, time);
+
+        pdata->splits[pdata->nsplits++] = time;
+        P_ARENA_DATA(p->arena, arenaKey)->standingsdirty = 1;
+        chat->SendMessage(p, "Checkpoint %i: %.3f seconds", region, (float)time / 1000);
+    }
+    else
+    {
+        lm->LogP(L_INFO, "racing", p, "finished: raw %d ms, corrected %d ms", raw, time);
+        Finish(p, time);
+    }
+}
+
 /* When a player crosses the finish line */
+local void Finish(Player *p, int time)
+{
+    Adata *adata = P_ARENA_DATA(p->arena, arenaKey);
+    Pdata *pdata = PPDATA(p, playerKey);
+    Heat *heat = &adata->heats[pdata->heat];
+
+    pdata->won = 1;
+    pdata->finishedrace = adata->race;
+    pdata->finishtime = time;
+    pdata->place = ++adata->placed;
+    adata->standingsdirty = 1;
+    heat->remaining--;
+
+    heat->finished++;
+    if (adata->nheats == 1)
+        chat->SendArenaSoundMessage(p->arena, 103, "%s reached the finish line %i%s with a time of %.3f seconds!", 
+            p->name, 
+            heat->finished, 
+            suffix(heat->finished), 
+            (float)time / 1000);
+    else if (heat->final)
+        chat->SendArenaSoundMessage(p->arena, 103, "%s finished the final %i%s with a time of %.3f seconds!", 
+            p->name, 
+            heat->finished, 
+            suffix(heat->finished), 
+            (float)time / 1000);
+    else
+        chat->SendArenaSoundMessage(p->arena, 103, "%s finished heat %i %i%s with a time of %.3f seconds!", 
+            p->name, 
+            pdata->heat + 1,
+            heat->finished, 
+            suffix(heat->finished), 
+            (float)time / 1000);
+    SetScore(p, time);
+    ClearSamples(p);
+    
+    //may stop the race and free the heats
+    if (!heat->remaining)
+        HeatDone(p->arena, heat);
+}
+
+/* When a player enters a checkpoint or the finish line */
 local void EnterRegion(Player *p, Region *rgn, int x, int y, int entering)
 {
     Adata *adata = P_ARENA_DATA(p->arena, arenaKey);
     const char *rname = mapdata->RegionName(rgn);
-    const char *s = "finish";
     Pdata *pdata = PPDATA(p, playerKey);
+    int region;
     
-    if (!adata->started)
+    if (adata->started != 2 || !entering)
     {
         return;
     }
     
-    if (!IS_STANDARD(p) || p->p_ship == SHIP_SPEC || pdata->won)
+    if (!pdata->racing || pdata->won || pdata->pending)
     {
         return;
     }
-    
-    if (strcmp(rname, s) != 0)
+
+    Heat *heat = &adata->heats[pdata->heat];
+    if (heat->state != HEAT_RUNNING)
     {
         return;
     }
     
-    
-    pdata->won = 1;
-    
-    adata->finished++;
-    float time = (current_millis() - adata->starttime);
-    chat->SendArenaSoundMessage(p->arena, 103, "%s reached the finish line %i%s with a time of %.3f seconds!", 
-        p->name, 
-        adata->finished, 
-        suffix(adata->finished), 
-        time / 1000);
-    SetScore(p, time);
-    
-    Link *link;
-    Player *g;
-    int remaining = 0;
-    
-    pd->Lock();
-    FOR_EACH_PLAYER(g)
+    if (strcmp(rname, "finish") == 0)
     {
-        if (g->arena == p->arena)
-        {
-            Pdata *gdata = PPDATA(g, playerKey);
-            if (g->p_ship != SHIP_SPEC && gdata->won == 0)
-                remaining++;
-        }
+        region = -1;
     }
-    pd->Unlock();
-    
-    if (!remaining)
+    else if (strncmp(rname, "checkpoint", 10) == 0)
     {
-        Stop(p->arena);
-        chat->SendArenaMessage(p->arena,"Race over!");
+        //checkpoints only count when taken in order
+        region = atoi(rname + 10);
+        if (region != pdata->nsplits + 1 || pdata->nsplits >= RACE_MAX_SPLITS)
+            return;
+    }
+    else
+    {
+        return;
     }
     
+    int raw = current_millis() - heat->starttime;
+
+    /* The region and position callbacks for one packet run back to back,
+     * in either order. If the position was handled this tick, it is the
+     * packet that brought the player here; otherwise wait for it. */
+    if (pdata->ppkrecv && pdata->ppkrecv == current_ticks())
+    {
+        Crossed(p, region, raw, pdata->ppktime, pdata->ppkrecv);
+    }
+    else
+    {
+        pdata->pending = region;
+        pdata->pendingraw = raw;
+        pdata->pendingtick = current_ticks();
+        pdata->pendingctime = pdata->ppktime;
+        pdata->pendingrecv = pdata->ppkrecv;
+    }
 }
 
 /************************************************************************/
@@ -803,7 +2615,10 @@ local void cHost(const char *command, const char *params, Player *p, const Targe
         chat->SendMessage(p, "-------------------------------------------------------------------");
         chat->SendMessage(p, "Parameters:  ships: -s(#)");
         chat->SendMessage(p, "      mystery mode: -m");
-        chat->SendMessage(p, "Example: ?start race -s(1,4,5) -m");
+        chat->SendMessage(p, "         heat size: -h(#)");
+        chat->SendMessage(p, "  finalists / heat: -a(#)");
+        chat->SendMessage(p, "    parallel gates: -p");
+        chat->SendMessage(p, "Example: ?start race -s(1,4,5) -m -h(8) -a(2)");
     }
     else
     {
@@ -856,7 +2671,13 @@ local void cTime(const char *command, const char *params, Player *p, const Targe
     Adata *adata = P_ARENA_DATA(p->arena, arenaKey);
     if (adata->started == 2)
     {
-        float time = current_millis() - adata->starttime;
+        //time the racer's own heat if they are in one that is running
+        Pdata *pdata = PPDATA(p, playerKey);
+        int start = adata->starttime;
+        if (pdata->racing && adata->heats[pdata->heat].state == HEAT_RUNNING)
+            start = adata->heats[pdata->heat].starttime;
+
+        float time = current_millis() - start;
         chat->SendMessage(p, "Time passed: %.01f seconds", time/1000);
     }
     else
@@ -875,13 +2696,13 @@ local void cBest(const char *command, const char *params, Player *p, const Targe
     if (target->type == T_PLAYER)
     {
         Player *t = target->u.p;
-        db->Query(db_best, p, 1, "SELECT * FROM `racestats` WHERE name=? AND arena=? AND time=(SELECT MIN(time) FROM racestats WHERE name=? AND arena=?);",
-            t->name, p->arena->basename, t->name, p->arena->basename);
+        db->Query(db_best, p, 1, SELECT_PERSONAL_BEST,
+            p->arena->basename, t->name);
     }
     else
     {
-        db->Query(db_best, p, 1, "SELECT * FROM `racestats` WHERE name=? AND arena=? AND time=(SELECT MIN(time) FROM racestats WHERE name=? AND arena=?);",
-            p->name, p->arena->basename, p->name, p->arena->basename);
+        db->Query(db_best, p, 1, SELECT_PERSONAL_BEST,
+            p->arena->basename, p->name);
     }
 }
 
@@ -894,8 +2715,195 @@ local helptext_t trackbest_help =
 //trackbest
 local void cTrackBest(const char *command, const char *params, Player *p, const Target *target)
 {
-    db->Query(db_tbest, p, 1, "SELECT * FROM `racestats` WHERE arena=? AND time=(SELECT MIN(time) FROM racestats WHERE arena=?);",
-        p->arena->basename, p->arena->basename);
+    db->Query(db_tbest, p, 1, SELECT_TRACK_BEST, p->arena->basename);
+}
+
+/* Returned result from ?raceapprove without an id */
+local void db_heldlist(int status, db_res *res, void *clos)
+{
+    Player *p = (Player*)clos;
+
+    if (status != 0 || res == NULL)
+        return;
+
+    if (db->GetRowCount(res) < 1)
+    {
+        chat->SendMessage(p, "There are no held results for this arena.");
+        return;
+    }
+
+    db_row *row;
+    while ((row = db->GetRow(res)))
+    {
+        chat->SendMessage(p, "#%s: %s, %.3f seconds in ship %i - %s", db->GetField(row, 0),
+            db->GetField(row, 2), (float)atoi(db->GetField(row, 1)) / 1000,
+            atoi(db->GetField(row, 3)) + 1, db->GetField(row, 4));
+    }
+}
+
+/* The held row, read before it is deleted */
+local void db_heldrow(int status, db_res *res, void *clos)
+{
+    HeldQuery *query = clos;
+    db_row *row;
+
+    if (status != 0 || res == NULL || !(row = db->GetRow(res)))
+        return;
+
+    query->found = 1;
+    astrncpy(query->name, db->GetField(row, 2), sizeof(query->name));
+    query->time = atoi(db->GetField(row, 1));
+    query->ship = atoi(db->GetField(row, 3));
+}
+
+/* Whether the DELETE took the held row out. Two staff, or one staff member
+ * twice, may be after the same id, and only one of them gets a 1 here. */
+local int Deleted(int status, db_res *res, HeldQuery *query)
+{
+    db_row *row;
+
+    if (status != 0 || res == NULL || !(row = db->GetRow(res)))
+        return 0;
+    return query->found && atoi(db->GetField(row, 0)) == 1;
+}
+
+/* Read, delete and count a held result, then hand it to cb */
+local void TakeHeld(Player *p, int id, query_callback cb)
+{
+    HeldQuery *query = calloc(1, sizeof(HeldQuery));
+    if (!query)
+        return;
+
+    query->id = id;
+    astrncpy(query->staff, p->name, sizeof(query->staff));
+    astrncpy(query->arena, p->arena->name, sizeof(query->arena));
+
+    db->Query(db_heldrow, query, 1, SELECT_HELD, (unsigned int)id, p->arena->basename);
+    db->Query(NULL, NULL, 0, DELETE_HELD, (unsigned int)id, p->arena->basename);
+    db->Query(cb, query, 1, SELECT_DELETED);
+}
+
+/* Returned result from ?raceapprove <id>: store it like any other result */
+local void db_approve(int status, db_res *res, void *clos)
+{
+    HeldQuery *query = clos;
+    Player *p = pd->FindPlayer(query->staff);
+    Arena *arena = aman->FindArena(query->arena, NULL, NULL);
+
+    if (!Deleted(status, res, query))
+    {
+        if (p)
+            chat->SendMessage(p, "There is no held result #%i in this arena.", query->id);
+        free(query);
+        return;
+    }
+
+    if (!arena)
+    {
+        lm->Log(L_WARN, "<racing> {%s} approved held result #%i (%s, %i ms) could not be stored",
+            query->arena, query->id, query->name, query->time);
+        free(query);
+        return;
+    }
+
+    /* It goes straight into the records and the ladder. It was never
+     * part of any race here, so it stays out of a race's results, and
+     * out of the export. */
+    Adata *adata = P_ARENA_DATA(arena, arenaKey);
+    if (query->time && adata->recordready && (!adata->bestime || query->time < adata->bestime))
+    {
+        adata->newrecord = 1;
+        adata->bestime = query->time;
+        adata->bestship = query->ship + 1;
+        astrncpy(adata->bestname, query->name, sizeof(adata->bestname));
+    }
+
+    RaceResult r;
+    memset(&r, 0, sizeof(r));
+    astrncpy(r.name, query->name, sizeof(r.name));
+    r.ship = query->ship;
+    r.time = query->time;
+    StoreResults(arena, &r, 1);
+
+    chat->SendArenaMessage(arena, "%s's held time of %.3f seconds has been approved by %s.",
+        query->name, (float)query->time / 1000, query->staff);
+    free(query);
+}
+
+/* Returned result from ?racereject <id> */
+local void db_reject(int status, db_res *res, void *clos)
+{
+    HeldQuery *query = clos;
+    Player *p = pd->FindPlayer(query->staff);
+
+    if (p)
+    {
+        if (Deleted(status, res, query))
+            chat->SendMessage(p, "Held result #%i rejected.", query->id);
+        else
+            chat->SendMessage(p, "There is no held result #%i in this arena.", query->id);
+    }
+    free(query);
+}
+
+/* ?raceapprove help information */
+local helptext_t raceapprove_help =
+"Targets: none\n"
+"Args: [id]\n"
+"Without an id, lists results held back by the speed check in this arena.\n"
+"With one, stores that result in the race records as if it had never been held.\n";
+
+//raceapprove
+local void cRaceApprove(const char *command, const char *params, Player *p, const Target *target)
+{
+    int id = atoi(params);
+
+    if (id < 1)
+    {
+        db->Query(db_heldlist, p, 1, SELECT_HELD_LIST, p->arena->basename);
+        return;
+    }
+
+    TakeHeld(p, id, db_approve);
+}
+
+/* ?racereject help information */
+local helptext_t racereject_help =
+"Targets: none\n"
+"Args: <id>\n"
+"Throws away a result held back by the speed check in this arena.\n";
+
+//racereject
+local void cRaceReject(const char *command, const char *params, Player *p, const Target *target)
+{
+    int id = atoi(params);
+
+    if (id < 1)
+    {
+        chat->SendMessage(p, "Usage: ?racereject <id>");
+        return;
+    }
+
+    TakeHeld(p, id, db_reject);
+}
+
+/* ?raceladder help information */
+local helptext_t raceladder_help =
+"Targets: none\n"
+"Args: [page]\n"
+"Displays the racing ladder, which scores every racer's best time on each\n"
+"track against that track's record. Ten racers are shown per page.\n";
+
+//raceladder
+local void cRaceLadder(const char *command, const char *params, Player *p, const Target *target)
+{
+    Pdata *pdata = PPDATA(p, playerKey);
+    int page = atoi(params);
+    if (page < 1)
+        page = 1;
+
+    pdata->ladderpage = page - 1;
+    db->Query(db_ladder, p, 1, SELECT_LADDER_PAGE, (unsigned int)(page - 1) * 10);
 }
 
 /************************************************************************/
@@ -916,19 +2924,27 @@ EXPORT int MM_racing(int action, Imodman *mm_, Arena *arena)
         chat = mm->GetInterface(I_CHAT, ALLARENAS);
         cmd = mm->GetInterface(I_CMDMAN, ALLARENAS);
         cs = mm->GetInterface(I_CLIENTSET, ALLARENAS);
+        fake = mm->GetInterface(I_FAKE, ALLARENAS);
         game = mm->GetInterface(I_GAME, ALLARENAS);
+        lagq = mm->GetInterface(I_LAGQUERY, ALLARENAS);
+        lm = mm->GetInterface(I_LOGMAN, ALLARENAS);
         ml = mm->GetInterface(I_MAINLOOP, ALLARENAS);
         mapdata = mm->GetInterface(I_MAPDATA, ALLARENAS);
+        obj = mm->GetInterface(I_OBJECTS, ALLARENAS); //optional: only the LVZ standings need it
         pd = mm->GetInterface(I_PLAYERDATA, ALLARENAS);
         db = mm->GetInterface(I_RELDB, ALLARENAS);
 
-        if (!aman || !cfg || !chat || !cmd || !cs || !game || !ml || !mapdata || !pd || !db)
+        if (!aman || !cfg || !chat || !cmd || !cs || !fake || !game || !lagq || !lm || !ml || !mapdata || !pd || !db)
         {
             mm->ReleaseInterface(db);
             mm->ReleaseInterface(pd);
+            mm->ReleaseInterface(obj);
             mm->ReleaseInterface(mapdata);
             mm->ReleaseInterface(ml);
+            mm->ReleaseInterface(lm);
+            mm->ReleaseInterface(lagq);
             mm->ReleaseInterface(game);
+            mm->ReleaseInterface(fake);
             mm->ReleaseInterface(cs);
             mm->ReleaseInterface(cmd);
             mm->ReleaseInterface(chat);
@@ -946,9 +2962,13 @@ EXPORT int MM_racing(int action, Imodman *mm_, Arena *arena)
             {
                 mm->ReleaseInterface(db);
                 mm->ReleaseInterface(pd);
+                mm->ReleaseInterface(obj);
                 mm->ReleaseInterface(mapdata);
                 mm->ReleaseInterface(ml);
+                mm->ReleaseInterface(lm);
+                mm->ReleaseInterface(lagq);
                 mm->ReleaseInterface(game);
+                mm->ReleaseInterface(fake);
                 mm->ReleaseInterface(cs);
                 mm->ReleaseInterface(cmd);
                 mm->ReleaseInterface(chat);
@@ -960,20 +2980,27 @@ EXPORT int MM_racing(int action, Imodman *mm_, Arena *arena)
             else
             {
                 init_db();
+                StartExport();
                 return MM_OK;
             }
         }
     }
     else if (action == MM_UNLOAD)
     {
+        StopExport();
+
         pd->FreePlayerData(playerKey);
         aman->FreeArenaData(arenaKey);
 
         mm->ReleaseInterface(db);
         mm->ReleaseInterface(pd);
+        mm->ReleaseInterface(obj);
         mm->ReleaseInterface(mapdata);
         mm->ReleaseInterface(ml);
+        mm->ReleaseInterface(lm);
+        mm->ReleaseInterface(lagq);
         mm->ReleaseInterface(game);
+        mm->ReleaseInterface(fake);
         mm->ReleaseInterface(cs);
         mm->ReleaseInterface(cmd);
         mm->ReleaseInterface(chat);
@@ -987,6 +3014,14 @@ EXPORT int MM_racing(int action, Imodman *mm_, Arena *arena)
     {
         ok_Doors = cs->GetOverrideKey("Door", "Doormode");
 
+        //the rocket area is built when a race starts, once the map is loaded
+        Adata *adata = P_ARENA_DATA(arena, arenaKey);
+        adata->rocketbits = NULL;
+
+        //have the track record ready before anyone races
+        adata->recordready = 0;
+        LoadRecord(arena);
+
         cmd->AddCommand("host", cHost, arena, host_help);
         cmd->AddCommand("start", cHost, arena, host_help);
         cmd->AddCommand("stopevent", cStopEvent, arena, stop_help);
@@ -995,14 +3030,32 @@ EXPORT int MM_racing(int action, Imodman *mm_, Arena *arena)
         cmd->AddCommand("time", cTime, arena, time_help);
         cmd->AddCommand("best", cBest, arena, best_help);
         cmd->AddCommand("trackbest", cTrackBest, arena, trackbest_help);
+        cmd->AddCommand("raceladder", cRaceLadder, arena, raceladder_help);
+        cmd->AddCommand("raceapprove", cRaceApprove, arena, raceapprove_help);
+        cmd->AddCommand("racereject", cRaceReject, arena, racereject_help);
         
         return MM_OK;
     }
     else if (action == MM_DETACH)
     {
         ml->ClearTimer(TimeUp, arena);
+        ml->ClearTimer(WaitRecord, arena);
+        ml->ClearTimer(NextWave, arena);
         ml->ClearTimer(RocketArea, arena);
+        ml->ClearTimer(StandingsTick, arena);
+
+        EndGhost(arena);
+        FlushResults(arena);
+        FreeResults(arena);
+        ClearHeats(arena);
+
+        Adata *adata = P_ARENA_DATA(arena, arenaKey);
+        free(adata->rocketbits);
+        adata->rocketbits = NULL;
         
+        cmd->RemoveCommand("racereject", cRaceReject, arena);
+        cmd->RemoveCommand("raceapprove", cRaceApprove, arena);
+        cmd->RemoveCommand("raceladder", cRaceLadder, arena);
         cmd->RemoveCommand("trackbest", cTrackBest, arena);
         cmd->RemoveCommand("best", cBest, arena);
         cmd->RemoveCommand("time", cTime, arena);
@@ -0,0 +1,25 @@
+#ifndef SQLHEX_H_INCLUDED
+#define SQLHEX_H_INCLUDED
+
+/* Shared by the event modules that write many rows in one statement.
+ *
+ * AppendHex adds str to the query in buf as a hex literal (x'...') at
+ * pos, and returns the new end of the query. Such queries are passed to
+ * Query() as its format, so they must not contain any placeholders, and
+ * hex spares escaping player names. Output stops short of len.
+ */
+local int AppendHex(char *buf, int pos, int len, const char *str)
+{
+    static const char digits[] = "0123456789ABCDEF";
+
+    pos += snprintf(buf + pos, len - pos, "x'");
+    for (; *str && pos < len - 4; str++)
+    {
+        buf[pos++] = digits[(unsigned char)*str >> 4];
+        buf[pos++] = digits[(unsigned char)*str & 0x0F];
+    }
+    pos += snprintf(buf + pos, len - pos, "'");
+    return pos;
+}
+
+#endif